@@ -0,0 +1,132 @@
+#!/usr/bin/env python3
+#
+# Copyright (c) 2019, Ari Suutari <ari@stonepile.fi>.
+# All rights reserved. 
+# 
+# Redistribution and use in source and binary forms, with or without
+# modification, are permitted provided that the following conditions
+# are met:
+# 
+#  1. Redistributions of source code must retain the above copyright
+#     notice, this list of conditions and the following disclaimer.
+#  2. Redistributions in binary form must reproduce the above copyright
+#     notice, this list of conditions and the following disclaimer in the
+#     documentation and/or other materials provided with the distribution.
+#  3. The name of the author may not be used to endorse or promote
+#     products derived from this software without specific prior written
+#     permission. 
+# 
+# THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS
+# OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+# WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+# ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT,
+# INDIRECT,  INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+# (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+# SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+# HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+# STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+# ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+# OF THE POSSIBILITY OF SUCH DAMAGE.
+#
+# Convert CBOR payload published by emw-sensor to JSON.
+# Reads CBOR from file given as argument (or stdin),
+# writes JSON with same structure as json payload format.
+#
+
+import json
+import struct
+import sys
+
+class Decoder:
+
+    def __init__(self, data):
+        self.data = data
+        self.pos = 0
+
+    def byte(self):
+        b = self.data[self.pos]
+        self.pos += 1
+        return b
+
+    def take(self, n):
+        b = self.data[self.pos:self.pos + n]
+        if len(b) != n:
+            raise ValueError("truncated payload")
+        self.pos += n
+        return b
+
+    def argument(self, info):
+        if info < 24:
+            return info
+        if info == 24:
+            return self.byte()
+        if info == 25:
+            return struct.unpack(">H", self.take(2))[0]
+        if info == 26:
+            return struct.unpack(">I", self.take(4))[0]
+        if info == 27:
+            return struct.unpack(">Q", self.take(8))[0]
+        raise ValueError("unsupported length %d" % info)
+
+    def item(self):
+        ib = self.byte()
+        major = ib >> 5
+        info = ib & 0x1f
+
+        if major == 0:
+            return self.argument(info)
+        if major == 1:
+            return -1 - self.argument(info)
+        if major == 3:
+            return self.take(self.argument(info)).decode("utf-8")
+        if major == 4:
+            if info == 31:
+                result = []
+                while self.data[self.pos] != 0xff:
+                    result.append(self.item())
+                self.pos += 1
+                return result
+            return [self.item() for i in range(self.argument(info))]
+        if major == 5:
+            result = {}
+            if info == 31:
+                while self.data[self.pos] != 0xff:
+                    key = self.item()
+                    result[key] = self.item()
+                self.pos += 1
+                return result
+            for i in range(self.argument(info)):
+                key = self.item()
+                result[key] = self.item()
+            return result
+        if major == 7:
+            if info == 20:
+                return False
+            if info == 21:
+                return True
+            if info == 22:
+                return None
+            if info == 25:
+                return struct.unpack(">e", self.take(2))[0]
+            if info == 26:
+                return struct.unpack(">f", self.take(4))[0]
+            if info == 27:
+                return struct.unpack(">d", self.take(8))[0]
+        raise ValueError("unsupported item 0x%02x" % ib)
+
+def decode(data):
+    d = Decoder(data)
+    result = d.item()
+    if d.pos != len(data):
+        raise ValueError("%d extra bytes after payload" % (len(data) - d.pos))
+    return result
+
+if __name__ == "__main__":
+    if len(sys.argv) > 1:
+        with open(sys.argv[1], "rb") as f:
+            data = f.read()
+    else:
+        data = sys.stdin.buffer.read()
+
+    json.dump(decode(data), sys.stdout, indent=2)
+    print()
@@ -0,0 +1,200 @@
+/*
+ * Copyright (c) 2019, Ari Suutari <ari@stonepile.fi>.
+ * All rights reserved. 
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 
+ *  1. Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *  3. The name of the author may not be used to endorse or promote
+ *     products derived from this software without specific prior written
+ *     permission. 
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS
+ * OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT,
+ * INDIRECT,  INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Clock confidence. Error of system clock is estimated
+ * from residual error left at last SNTP response and
+ * drift since then. SNTP is needed only when estimate
+ * exceeds configured bound.
+ */
+
+#include <picoos.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <limits.h>
+#include <time.h>
+#include <sys/time.h>
+#include <eshell.h>
+
+#include "emw-sensor.h"
+
+#define DEFAULT_CLOCK_DRIFT_PPM 100
+#define DEFAULT_CLOCK_BOUND_MS  1000
+#define DRIFT_MIN_SECS          3600
+#define CLOCK_STEP_MS           20
+#define RTC_RESTORE_MS          500
+
+static time_t lastSync = 0;    // time of last SNTP response
+static time_t lastStep = 0;    // time clock was last set
+static int    syncResidual;    // clock error left after it, ms
+static bool   residualKnown;   // false if estimated after restore
+static int    driftPpm = 0;    // measured drift
+
+static int configInt(const char* key, int def)
+{
+  const char* value = uosConfigGet(key);
+
+  if (value == NULL || value[0] == '\0')
+    return def;
+
+  return atoi(value);
+}
+
+static int clockDrift()
+{
+  int ppm = configInt("clock.drift", DEFAULT_CLOCK_DRIFT_PPM);
+
+  return driftPpm > ppm ? driftPpm : ppm;
+}
+
+/*
+ * Expected clock error in ms, -1 if clock has
+ * never been synchronized.
+ */
+int clockError()
+{
+  time_t now;
+
+  if (lastSync == 0 || !timeOk())
+    return -1;
+
+  time(&now);
+  return abs(syncResidual) + (int)((int64_t)(now - lastSync) * clockDrift() / 1000);
+}
+
+bool clockNeedsSync()
+{
+  int err = clockError();
+
+  return err < 0 || err > configInt("clock.bound", DEFAULT_CLOCK_BOUND_MS);
+}
+
+/*
+ * Continue from last synchronization if clock was
+ * restored from RTC. Restored time is within half
+ * a second, see rtcInit.
+ */
+void clockRestore()
+{
+  lastSync = 0;
+  lastStep = 0;
+  driftPpm = 0;
+  residualKnown = false;
+  if (!timeOk())
+    return;
+
+  lastSync = rtcLastSync();
+  syncResidual = RTC_RESTORE_MS;
+}
+
+/*
+ * Handle SNTP response. Clock is set if it is off by
+ * more than a few ms or more than 24 hours have passed
+ * since it was set. Returns true if clock was set.
+ */
+bool clockSync(time_t t, uint32_t us)
+{
+  struct timeval tv;
+  int64_t error;
+
+  gettimeofday(&tv, NULL);
+
+  // Learn drift from error (in ms) that accumulated since
+  // last response.
+  error = ((int64_t)tv.tv_sec - t) * 1000 + ((int32_t)tv.tv_usec - (int32_t)us) / 1000;
+  if (residualKnown && t - lastSync >= DRIFT_MIN_SECS)
+    driftPpm = llabs(error - syncResidual) * 1000 / (t - lastSync);
+
+  lastSync = t;
+  syncResidual = (error > INT_MAX || error < -INT_MAX) ? INT_MAX : (int)error;
+  residualKnown = true;
+  rtcSetLastSync(t);
+
+  if (llabs(error) <= CLOCK_STEP_MS && llabs(t - lastStep) <= 3600 * 24)
+    return false;
+
+  lastStep = t;
+  syncResidual = 0;
+  tv.tv_sec = t;
+  tv.tv_usec = us;
+  settimeofday(&tv, NULL);
+  rtcSetTime(&tv);
+  return true;
+}
+
+/*
+ * Show clock confidence, set drift and error bound.
+ */
+static int clockInfo(EshContext* ctx)
+{
+  char* drift = eshNamedArg(ctx, "drift", false);
+  char* bound = eshNamedArg(ctx, "bound", false);
+
+  eshCheckNamedArgsUsed(ctx);
+  eshCheckArgsUsed(ctx);
+  if (eshArgError(ctx) != EshOK)
+    return -1;
+
+  if (drift != NULL)
+    uosConfigSet("clock.drift", drift);
+
+  if (bound != NULL)
+    uosConfigSet("clock.bound", bound);
+
+  if (drift != NULL || bound != NULL)
+    return 0;
+
+  time_t now;
+
+  time(&now);
+  if (lastSync == 0)
+    eshPrintf(ctx, "Clock not synchronized.\n");
+  else
+    eshPrintf(ctx, "Last SNTP response %d s ago, residual %d ms%s.\n", (int)(now - lastSync), syncResidual,
+                   residualKnown ? "" : " (restored from RTC)");
+
+  eshPrintf(ctx, "Drift %d ppm (measured %d ppm), expected error %d ms, bound %d ms.\n",
+                 clockDrift(),
+                 driftPpm,
+                 clockError(),
+                 configInt("clock.bound", DEFAULT_CLOCK_BOUND_MS));
+  eshPrintf(ctx, "Jiffies drift %d ms from RTC, %d backsteps.\n", rtcTickDrift(), rtcTickBacksteps());
+  return 0;
+}
+
+const EshCommand clockCommand = {
+  .flags = 0,
+  .name = "clock",
+  .help = "show clock error estimate, set drift in ppm (--drift=)\n"
+          "and error bound in ms before SNTP is used (--bound=)",
+  .handler = clockInfo
+};
@@ -87,9 +87,12 @@
 
 #define LWIP_COMPAT_SOCKETS		0
 
-void setSystemTime(time_t);
+void setSystemTime(time_t, uint32_t);
 
-#define SNTP_SET_SYSTEM_TIME(t) setSystemTime(t)
+// Pass fraction of second too, clock confidence needs it.
+#define SNTP_CALC_TIME_US 1
+#define SNTP_SET_SYSTEM_TIME_US(t, us) setSystemTime(t, us)
+#define SNTP_SET_SYSTEM_TIME(t) setSystemTime(t, 0)
 #define LWIP_DHCP_GET_NTP_SRV 1
 #define SNTP_SERVER_DNS 1
 // need one more timeout for ntp
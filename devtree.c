@@ -132,6 +132,7 @@ void flashPowerdown()
   uosSpiBegin(&flashDev.base);
   uosSpiXmit(&flashDev.base, &cmd, 1);
   uosSpiEnd(&flashDev.base);
+  energyOff(ENERGY_FLASH);
 }
 
 void flashPowerup()
@@ -140,4 +141,5 @@ void flashPowerup()
   uosSpiBegin(&flashDev.base);
   uosSpiXmit(&flashDev.base, &cmd, 1);
   uosSpiEnd(&flashDev.base);
+  energyOn(ENERGY_FLASH);
 }
@@ -31,18 +31,52 @@
 #include <picoos-lwip.h>
 #include "lwip/netif.h"
 
-#define MAX_SENSORS 3
+#if EMW_HOST
+#include "host-sim.h"
+#endif
+
+/*
+ * Default size of sensor table, can be changed
+ * with onewire --max.
+ */
+#define DEFAULT_MAX_SENSORS 8
+#define MAX_SENSORS_LIMIT   100
 
 #define MEAS_CYCLE_SECS (10 * 60)
 #define SEND_CYCLE_SECS (60 * 60)
 
-#define MAX_HISTORY (1 + (SEND_CYCLE_SECS / MEAS_CYCLE_SECS))
+/*
+ * History must be able to hold samples of a long uplink outage.
+ */
+#define HISTORY_SECS (6 * 60 * 60)
+#define MAX_HISTORY (1 + (HISTORY_SECS / MEAS_CYCLE_SECS))
+
+/*
+ * Samples are stored as raw sensor values: temperatures
+ * in 1/16 C units, battery in ADC counts.
+ */
+#define SAMPLE_INVALID INT16_MIN
+#define sampleToCelsius(v) ((v) / 16.0)
+
+/*
+ * Battery is sampled with 12 bit resolution and
+ * BATTERY_OVERSAMPLE conversions are averaged, keeping
+ * two extra bits.
+ */
+#define BATTERY_OVERSAMPLE 16
+#define BATTERY_ADC_COUNTS (4096 * 4)
+#define BATTERY_VREF       3.3
 
 typedef struct {
 
   uint8_t addr[7];
+  bool    present;    // in saved inventory
+  bool    found;      // seen during last rom search
+  uint8_t resolution; // DS18B20 resolution in bits
+  bool    configPending;
+  int     historyHead;  // oldest sample in ring
   int     historyCount;
-  float   temperature[MAX_HISTORY];
+  int16_t history[MAX_HISTORY];
 
 #if USE_MQTT
   const char* location;
@@ -54,12 +88,98 @@ typedef struct {
 
 } Sensor;
 
+/*
+ * Access sensor history ring, index 0 is the oldest sample.
+ */
+#define sensorHistory(s, i) ((s)->history[((s)->historyHead + (i)) % MAX_HISTORY])
+
+/*
+ * Measurement window: histories of all sensors,
+ * newest samples taken at given time. Slot 0 is battery.
+ */
+typedef struct {
+
+  time_t  time;
+  int     timeStep;
+  int     count;
+  Sensor* sensors;
+  bool    live;       // current window in sensor table
+} Window;
+
+/*
+ * Payload being generated. When buf is NULL, only
+ * length is computed. Writes past size are dropped
+ * and flagged as overflow.
+ */
+#define PAYLOAD_JSON 0
+#define PAYLOAD_CBOR 1
+
+typedef struct {
+
+  int      format;
+  uint8_t* buf;
+  int      size;
+  int      len;
+  bool     overflow;
+  int      depth;
+  uint32_t first;     // bit per nesting level: no value yet
+} Payload;
+
+/*
+ * Phases of send cycle, see timing.c.
+ */
+typedef enum {
+
+  PHASE_WIFI_ON,      // wifi power on & firmware load
+  PHASE_JOIN,
+  PHASE_DHCP,
+  PHASE_SNTP,
+  PHASE_DNS,
+  PHASE_CONNECT,      // tcp connect & tls handshake
+  PHASE_PUBLISH,
+  PHASE_VERA,
+  PHASE_DRAIN,
+  PHASE_DOWN,
+  PHASE_COUNT
+} Phase;
+
+typedef struct {
+
+  time_t   time;
+  int      total;
+  uint16_t phase[PHASE_COUNT]; // ms
+} CycleTiming;
+
+/*
+ * Power states for energy accounting, see energy.c.
+ */
+typedef enum {
+
+  ENERGY_RUN,
+  ENERGY_STOP,
+  ENERGY_RADIO,
+  ENERGY_TX,
+  ENERGY_FLASH,
+  ENERGY_ADC,
+  ENERGY_STANDBY,
+  ENERGY_STATES
+} EnergyState;
+
+typedef struct {
+
+  int      elapsed;                // ms
+  uint32_t ms[ENERGY_STATES];
+  double   charge[ENERGY_STATES];  // uAh
+  double   total;
+} EnergyCycle;
+
 #define T_2017_01_01 1483228800
 
 bool timeOk(void);
 void initConfig(void);
 void potatoInit(void);
 bool potatoSend(void);
+void potatoClose(void);
 void buttonInit(void);
 bool buttonRead(void);
 bool staUp(void);
@@ -84,17 +204,71 @@ void sensorInit(void);
 void sensorLock(void);
 void sensorUnlock(void);
 void sensorClearHistory(void);
+int  sensorTimeStep(void);
+void sensorSaveInventory(void);
 void updateLastBatteryReading(void);
 bool isValidBattery(double v);
+double batteryVolts(int16_t counts);
 void owAddr2Str(char* str, const uint8_t* addr);
 void owStr2Addr(uint8_t* addr, const char* str);
 void sensorCycleReset(const struct timeval* tv);
+Sensor* sensorFind(const uint8_t* addr);
+void sensorWindow(Window* w);
+
+void spoolInit(void);
+bool spoolHistory(void);
+bool spoolRead(Window* w);
+void spoolFree(Window* w);
+void spoolAck(void);
+void spoolSync(void);
+int  spoolPending(void);
+
+void payloadInit(Payload* p, uint8_t* buf, int size, int format);
+void payloadStartObject(Payload* p);
+void payloadStartArray(Payload* p);
+void payloadEndObject(Payload* p);
+void payloadEndArray(Payload* p);
+void payloadKey(Payload* p, const char* key);
+void payloadString(Payload* p, const char* str);
+void payloadInteger(Payload* p, int value);
+void payloadDouble(Payload* p, double value);
+void payloadNull(Payload* p);
+
+void timingStart(void);
+void timingPhase(int phase, JIF_t start);
+void timingEnd(void);
+const CycleTiming* timingLast(void);
+const char* timingPhaseName(int phase);
+
+void energyInit(void);
+void energyOn(int state);
+void energyOff(int state);
+void energySample(void);
+void energyCycle(void);
+const EnergyCycle* energyLast(void);
+int  energyLifeDays(void);
+int  energyCurrent(int state);
+
+void rtcInit(void);
+void rtcSetTime(const struct timeval* tv);
+void rtcSetLastSync(time_t t);
+time_t rtcLastSync(void);
+void rtcTickCheck(void);
+int  rtcTickDrift(void);
+int  rtcTickBacksteps(void);
+
+void clockRestore(void);
+bool clockNeedsSync(void);
+int  clockError(void);
+bool clockSync(time_t t, uint32_t us);
 
 bool veraSend(void);
 
-extern Sensor sensorList[];
-extern float battery;
+extern Sensor* sensorList;
+extern int16_t battery;
 extern int    sensorCount;
+extern int    sensorCapacity;
+extern int    sensorOverflows;
 extern time_t sensorTime;
 extern POSSEMA_t sendSema;
 
@@ -0,0 +1,327 @@
+/*
+ * Copyright (c) 2019, Ari Suutari <ari@stonepile.fi>.
+ * All rights reserved. 
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 
+ *  1. Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *  3. The name of the author may not be used to endorse or promote
+ *     products derived from this software without specific prior written
+ *     permission. 
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS
+ * OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT,
+ * INDIRECT,  INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Energy accounting. Time spent in power states is
+ * integrated against a table of currents to estimate
+ * charge used by each cycle and battery life.
+ *
+ * MCU run time is taken from DWT cycle counter, which
+ * stops when core sleeps. Rest of wall clock time is
+ * counted as STOP mode. Other states are switched
+ * on and off by code controlling the hardware.
+ */
+
+#include <picoos.h>
+#include <picoos-u.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <eshell.h>
+
+#include "emw-sensor.h"
+
+/*
+ * Default battery capacity, mAh.
+ */
+#define DEFAULT_BATTERY_MAH 2500
+
+static const char* const stateNames[ENERGY_STATES] = {
+  "run",
+  "stop",
+  "radio",
+  "tx",
+  "flash",
+  "adc",
+  "standby"
+};
+
+/*
+ * Default currents, uA. Can be changed with
+ * energy command.
+ */
+static const int defaultCurrent[ENERGY_STATES] = {
+  10000,   // MCU running
+  20,      // MCU in STOP mode, including board leakage
+  40000,   // radio on, not transmitting
+  170000,  // radio transmitting
+  15,      // flash not in deep powerdown
+  1600,    // ADC enabled
+  250      // radio down, firmware resident
+};
+
+static bool     on[ENERGY_STATES];
+static JIF_t    since[ENERGY_STATES];
+static uint32_t ms[ENERGY_STATES];
+static uint64_t runCycles;
+static uint32_t lastCycleCount;
+static JIF_t    cycleStart;
+
+static EnergyCycle last;
+static double      totalCharge;  // uAh
+static double      totalHours;
+
+/*
+ * Current of given state in uA.
+ */
+int energyCurrent(int state)
+{
+  char        key[20];
+  const char* value;
+
+  sprintf(key, "energy.%s", stateNames[state]);
+  value = uosConfigGet(key);
+  if (value == NULL || value[0] == '\0')
+    return defaultCurrent[state];
+
+  return atoi(value);
+}
+
+static int batteryCapacity()
+{
+  const char* value = uosConfigGet("energy.battery");
+
+  if (value == NULL || value[0] == '\0')
+    return DEFAULT_BATTERY_MAH;
+
+  return atoi(value);
+}
+
+void energyInit()
+{
+  CoreDebug->DEMCR |= CoreDebug_DEMCR_TRCENA_Msk;
+  DWT->CYCCNT = 0;
+  DWT->CTRL  |= DWT_CTRL_CYCCNTENA_Msk;
+
+  lastCycleCount = 0;
+  cycleStart = jiffies;
+}
+
+void energyOn(int state)
+{
+  posTaskSchedLock();
+  if (!on[state]) {
+
+    on[state] = true;
+    since[state] = jiffies;
+  }
+
+  posTaskSchedUnlock();
+}
+
+void energyOff(int state)
+{
+  posTaskSchedLock();
+  if (on[state]) {
+
+    on[state] = false;
+    ms[state] += jiffies - since[state];
+  }
+
+  posTaskSchedUnlock();
+}
+
+/*
+ * Collect MCU cycle counter. Must be called before
+ * counter wraps, at 100 MHz that is after 40 seconds
+ * of run time. Sensor timer wakeup calls this on every
+ * measurement cycle, watchdog thread more often when online.
+ */
+void energySample()
+{
+  uint32_t count;
+
+  posTaskSchedLock();
+  count = DWT->CYCCNT;
+  runCycles += (uint32_t)(count - lastCycleCount);
+  lastCycleCount = count;
+  posTaskSchedUnlock();
+}
+
+/*
+ * Close accounting period. Called after each send
+ * cycle, so period includes sleep before it.
+ */
+void energyCycle()
+{
+  int      currents[ENERGY_STATES];
+  uint32_t t[ENERGY_STATES];
+  JIF_t    now;
+  int      elapsed;
+  uint32_t run;
+  double   charge;
+  int      i;
+
+  for (i = 0; i < ENERGY_STATES; i++)
+    currents[i] = energyCurrent(i);
+
+  energySample();
+
+  posTaskSchedLock();
+
+  now = jiffies;
+  elapsed = now - cycleStart;
+  cycleStart = now;
+
+  for (i = 0; i < ENERGY_STATES; i++) {
+
+    if (on[i]) {
+
+      ms[i] += now - since[i];
+      since[i] = now;
+    }
+  }
+
+  run = runCycles / (SystemCoreClock / 1000);
+  if (run > (uint32_t)elapsed)
+    run = elapsed;
+
+  runCycles = 0;
+  ms[ENERGY_RUN]  = run;
+  ms[ENERGY_STOP] = elapsed - run;
+
+  memcpy(t, ms, sizeof(t));
+  memset(ms, '\0', sizeof(ms));
+
+  posTaskSchedUnlock();
+
+  // Transmit time is part of radio on time.
+  if (t[ENERGY_TX] > t[ENERGY_RADIO])
+    t[ENERGY_TX] = t[ENERGY_RADIO];
+
+  charge = 0;
+  for (i = 0; i < ENERGY_STATES; i++) {
+
+    last.charge[i] = (double)currents[i] * (i == ENERGY_RADIO ? t[i] - t[ENERGY_TX] : t[i]) / 3600000.0;
+    charge += last.charge[i];
+  }
+
+  memcpy(last.ms, t, sizeof(t));
+  last.elapsed = elapsed;
+  last.total   = charge;
+
+  totalCharge += charge;
+  totalHours  += elapsed / 3600000.0;
+}
+
+/*
+ * Charge used by last cycle.
+ */
+const EnergyCycle* energyLast()
+{
+  if (last.elapsed == 0)
+    return NULL;
+
+  return &last;
+}
+
+/*
+ * Projected battery life in days, based on
+ * average current since startup.
+ */
+int energyLifeDays()
+{
+  double avg;
+
+  if (totalHours <= 0 || totalCharge <= 0)
+    return -1;
+
+  avg = totalCharge / totalHours;
+  return batteryCapacity() * 1000.0 / avg / 24;
+}
+
+/*
+ * Show energy usage, set currents.
+ */
+static int energy(EshContext* ctx)
+{
+  char* values[ENERGY_STATES];
+  char* battery = eshNamedArg(ctx, "battery", false);
+  int   i;
+  bool  set = (battery != NULL);
+
+  for (i = 0; i < ENERGY_STATES; i++) {
+
+    values[i] = eshNamedArg(ctx, stateNames[i], false);
+    if (values[i] != NULL)
+      set = true;
+  }
+
+  eshCheckNamedArgsUsed(ctx);
+  eshCheckArgsUsed(ctx);
+  if (eshArgError(ctx) != EshOK)
+    return -1;
+
+  if (set) {
+
+    char key[20];
+
+    for (i = 0; i < ENERGY_STATES; i++) {
+
+      if (values[i] == NULL)
+        continue;
+
+      sprintf(key, "energy.%s", stateNames[i]);
+      uosConfigSet(key, values[i]);
+    }
+
+    if (battery != NULL)
+      uosConfigSet("energy.battery", battery);
+
+    return 0;
+  }
+
+  eshPrintf(ctx, "%-6s %8s %10s %10s\n", "state", "uA", "ms", "uAh");
+  for (i = 0; i < ENERGY_STATES; i++)
+    eshPrintf(ctx, "%-6s %8d %10lu %10.2f\n",
+                   stateNames[i],
+                   energyCurrent(i),
+                   (unsigned long)last.ms[i],
+                   last.charge[i]);
+
+  eshPrintf(ctx, "Last cycle %d ms, %.2f uAh.\n", last.elapsed, last.total);
+  if (totalHours > 0)
+    eshPrintf(ctx, "Average %.1f uA, battery %d mAh, projected life %d days.\n",
+                   totalCharge / totalHours,
+                   batteryCapacity(),
+                   energyLifeDays());
+
+  return 0;
+}
+
+const EshCommand energyCommand = {
+  .flags = 0,
+  .name = "energy",
+  .help = "show energy usage of last cycle and projected battery life\n"
+          "set currents in uA (--run=,--stop=,--radio=,--tx=,--flash=,--adc=,--standby=)\n"
+          "set battery capacity in mAh (--battery=)",
+  .handler = energy
+};
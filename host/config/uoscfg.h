@@ -0,0 +1,58 @@
+/*
+ * Copyright (c) 2019, Ari Suutari <ari@stonepile.fi>.
+ * All rights reserved. 
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 
+ *  1. Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *  3. The name of the author may not be used to endorse or promote
+ *     products derived from this software without specific prior written
+ *     permission. 
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS
+ * OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT,
+ * INDIRECT,  INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * picoos-micro configuration for host build.
+ */
+
+#include "host-sim.h"
+
+#define _FS_READONLY 1
+#define UOSCFG_SPIN_USECS 2
+#define UOSCFG_NEWLIB_SYSCALLS 1
+#define UOSCFG_MAX_OPEN_FILES 15
+#define UOSCFG_MAX_MOUNT 3 // sockets, romfs, spiffs
+#define UOSCFG_FS_ROM 2
+#define UOSCFG_FAT 0
+#define UOSCFG_RING 1
+#define UOSCFG_CONFIG 1
+#define UOSCFG_CONFIG_PREALLOC 5
+
+#define UOSCFG_SPI_BUS 1
+
+typedef struct {
+
+  GPIO_TypeDef* gpioPort;
+  uint16_t gpioPin;
+} SpiCs;
+
+#define UOSCFG_SPI_CS_TYPE SpiCs
+#define UOSCFG_SPIFFS 1
+#define SPIFFS_USE_MAGIC                1
@@ -0,0 +1,143 @@
+/*
+ * Copyright (c) 2019, Ari Suutari <ari@stonepile.fi>.
+ * All rights reserved. 
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 
+ *  1. Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *  3. The name of the author may not be used to endorse or promote
+ *     products derived from this software without specific prior written
+ *     permission. 
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS
+ * OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT,
+ * INDIRECT,  INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * On target newlib system calls route file access to
+ * picoos-micro filesystems. Host build does the same for
+ * /flash and /firmware by wrapping libc calls
+ * (linked with -Wl,--wrap=open etc.).
+ */
+
+#include <picoos.h>
+#include <picoos-u.h>
+#include <stdarg.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#define FD_BASE 1000
+
+static UosFile* files[UOSCFG_MAX_OPEN_FILES];
+
+int   __real_open(const char* fn, int flags, ...);
+int   __real_close(int fd);
+ssize_t __real_read(int fd, void* buf, size_t len);
+ssize_t __real_write(int fd, const void* buf, size_t len);
+off_t __real_lseek(int fd, off_t offset, int whence);
+
+static bool isUosPath(const char* fn)
+{
+  return !strncmp(fn, "/flash/", 7) || !strncmp(fn, "/firmware/", 10);
+}
+
+static UosFile* uosFd(int fd)
+{
+  if (fd < FD_BASE || fd >= FD_BASE + UOSCFG_MAX_OPEN_FILES)
+    return NULL;
+
+  return files[fd - FD_BASE];
+}
+
+int __wrap_open(const char* fn, int flags, ...)
+{
+  va_list  ap;
+  int      mode = 0;
+  int      i;
+  UosFile* f;
+
+  if (flags & O_CREAT) {
+
+    va_start(ap, flags);
+    mode = va_arg(ap, int);
+    va_end(ap);
+  }
+
+  if (!isUosPath(fn))
+    return __real_open(fn, flags, mode);
+
+  for (i = 0; i < UOSCFG_MAX_OPEN_FILES; i++)
+    if (files[i] == NULL)
+      break;
+
+  if (i >= UOSCFG_MAX_OPEN_FILES) {
+
+    errno = EMFILE;
+    return -1;
+  }
+
+  f = uosFileOpen(fn, flags, mode);
+  if (f == NULL)
+    return -1;
+
+  files[i] = f;
+  return FD_BASE + i;
+}
+
+int __wrap_close(int fd)
+{
+  UosFile* f = uosFd(fd);
+
+  if (f == NULL)
+    return __real_close(fd);
+
+  files[fd - FD_BASE] = NULL;
+  return uosFileClose(f);
+}
+
+ssize_t __wrap_read(int fd, void* buf, size_t len)
+{
+  UosFile* f = uosFd(fd);
+
+  if (f == NULL)
+    return __real_read(fd, buf, len);
+
+  return uosFileRead(f, buf, len);
+}
+
+ssize_t __wrap_write(int fd, const void* buf, size_t len)
+{
+  UosFile* f = uosFd(fd);
+
+  if (f == NULL)
+    return __real_write(fd, buf, len);
+
+  return uosFileWrite(f, buf, len);
+}
+
+off_t __wrap_lseek(int fd, off_t offset, int whence)
+{
+  UosFile* f = uosFd(fd);
+
+  if (f == NULL)
+    return __real_lseek(fd, offset, whence);
+
+  return uosFileSeek(f, offset, whence);
+}
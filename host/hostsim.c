@@ -0,0 +1,247 @@
+/*
+ * Copyright (c) 2019, Ari Suutari <ari@stonepile.fi>.
+ * All rights reserved. 
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 
+ *  1. Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *  3. The name of the author may not be used to endorse or promote
+ *     products derived from this software without specific prior written
+ *     permission. 
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS
+ * OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT,
+ * INDIRECT,  INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Simulated stm32 peripherals for host build.
+ * Battery voltage seen by ADC can be set with
+ * EMW_BATTERY environment variable (volts).
+ */
+
+#include <picoos.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <time.h>
+#include "emw-sensor.h"
+
+GPIO_TypeDef simGpio[3];
+PWR_TypeDef  simPwr;
+SCB_Type     simScb;
+SysTick_Type simSysTick;
+ADC_TypeDef  simAdc1;
+DMA_Stream_TypeDef simDma2Stream0;
+SPI_TypeDef  simSpi1;
+
+CoreDebug_Type simCoreDebug;
+uint32_t       SystemCoreClock = 100000000;
+
+static DWT_Type dwt;
+
+static bool watchdogReset;
+
+/*
+ * RTC calendar runs on host clock from the moment it was set.
+ * Jiffies follow host clock too, so jiffies against calendar
+ * is tested with simulated time in host/test/ticktest.c.
+ */
+static struct tm rtcCalendar = { .tm_mday = 1, .tm_year = 100 };
+static time_t    rtcSetAt;
+static uint32_t  rtcBackup[20];
+
+void GPIO_Init(GPIO_TypeDef* port, GPIO_InitTypeDef* init)
+{
+  if (init->GPIO_Mode == GPIO_Mode_IN) {
+
+    port->input |= init->GPIO_Pin;
+    if (init->GPIO_PuPd == GPIO_PuPd_UP)
+      port->idr |= init->GPIO_Pin;
+    else
+      port->idr &= ~init->GPIO_Pin;
+  }
+  else
+    port->input &= ~init->GPIO_Pin;
+}
+
+uint16_t GPIO_ReadInputData(GPIO_TypeDef* port)
+{
+  return (port->idr & port->input) | (port->odr & ~port->input);
+}
+
+uint8_t GPIO_ReadInputDataBit(GPIO_TypeDef* port, uint16_t pin)
+{
+  return (GPIO_ReadInputData(port) & pin) ? Bit_SET : Bit_RESET;
+}
+
+void GPIO_SetBits(GPIO_TypeDef* port, uint16_t pins)
+{
+  port->odr |= pins;
+}
+
+void GPIO_ResetBits(GPIO_TypeDef* port, uint16_t pins)
+{
+  port->odr &= ~pins;
+}
+
+void GPIO_WriteBit(GPIO_TypeDef* port, uint16_t pin, BitAction value)
+{
+  if (value == Bit_SET)
+    port->odr |= pin;
+  else
+    port->odr &= ~pin;
+}
+
+FlagStatus RCC_GetFlagStatus(uint8_t flag)
+{
+  return (flag == RCC_FLAG_IWDGRST && watchdogReset) ? SET : RESET;
+}
+
+void RCC_ClearFlag()
+{
+  watchdogReset = false;
+}
+
+void IWDG_Enable()
+{
+}
+
+void IWDG_ReloadCounter()
+{
+}
+
+void NVIC_SystemReset()
+{
+  printf("System reset requested, exiting.\n");
+  exit(1);
+}
+
+void ADC_Init(ADC_TypeDef* adc, ADC_InitTypeDef* init)
+{
+}
+
+void ADC_Cmd(ADC_TypeDef* adc, FunctionalState state)
+{
+  adc->enabled = (state == ENABLE);
+}
+
+void ADC_DMACmd(ADC_TypeDef* adc, FunctionalState state)
+{
+  adc->dma = (state == ENABLE);
+}
+
+/*
+ * Run conversions until DMA transfer is complete. Each
+ * sample gets a couple of LSBs of noise, like real ADC.
+ */
+void ADC_SoftwareStartConv(ADC_TypeDef* adc)
+{
+  DMA_Stream_TypeDef* dma = DMA2_Stream0;
+  const char* env = getenv("EMW_BATTERY");
+  double      volts = env ? atof(env) : 3.0;
+  int         value;
+
+  if (!adc->enabled || !adc->dma || !dma->enabled)
+    return;
+
+  while (dma->count > 0) {
+
+    value = volts / BATTERY_VREF * 4096 + (rand() % 5) - 2;
+    if (value < 0)
+      value = 0;
+    else if (value > 4095)
+      value = 4095;
+
+    adc->DR = value;
+    *dma->memory++ = adc->DR;
+    --dma->count;
+  }
+
+  dma->enabled = false;
+  dma->tc = true;
+  if (dma->tcInterrupt)
+    DMA2_Stream0_irq();
+}
+
+void DMA_Init(DMA_Stream_TypeDef* stream, DMA_InitTypeDef* init)
+{
+  stream->base  = (uint16_t*)init->DMA_Memory0BaseAddr;
+  stream->count = init->DMA_BufferSize;
+}
+
+/*
+ * Memory address is reloaded when stream is enabled,
+ * as in normal mode of real DMA.
+ */
+void DMA_Cmd(DMA_Stream_TypeDef* stream, FunctionalState state)
+{
+  if (state == ENABLE)
+    stream->memory = stream->base;
+
+  stream->enabled = (state == ENABLE);
+}
+
+FunctionalState DMA_GetCmdStatus(DMA_Stream_TypeDef* stream)
+{
+  return stream->enabled ? ENABLE : DISABLE;
+}
+
+void DMA_SetCurrDataCounter(DMA_Stream_TypeDef* stream, uint16_t count)
+{
+  stream->count = count;
+}
+
+void DMA_ITConfig(DMA_Stream_TypeDef* stream, uint32_t it, FunctionalState state)
+{
+  if (it & DMA_IT_TC)
+    stream->tcInterrupt = (state == ENABLE);
+}
+
+ITStatus DMA_GetITStatus(DMA_Stream_TypeDef* stream, uint32_t it)
+{
+  return (it == DMA_IT_TCIF0 && stream->tc) ? SET : RESET;
+}
+
+void DMA_ClearITPendingBit(DMA_Stream_TypeDef* stream, uint32_t it)
+{
+  if (it == DMA_IT_TCIF0)
+    stream->tc = false;
+}
+
+void DMA_ClearFlag(DMA_Stream_TypeDef* stream, uint32_t flags)
+{
+  if (flags & DMA_FLAG_TCIF0)
+    stream->tc = false;
+}
+
+/*
+ * AP mode setup needs real wifi chip.
+ */
+void setup()
+{
+  printf("Setup AP is not available in host build.\n");
+}
+
+DWT_Type* simDwt()
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+  dwt.CYCCNT = ts.tv_sec * SystemCoreClock + (uint64_t)ts.tv_nsec * SystemCoreClock / 1000000000;
+  return &dwt;
+}
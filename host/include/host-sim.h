@@ -0,0 +1,377 @@
+/*
+ * Copyright (c) 2019, Ari Suutari <ari@stonepile.fi>.
+ * All rights reserved. 
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 
+ *  1. Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *  3. The name of the author may not be used to endorse or promote
+ *     products derived from this software without specific prior written
+ *     permission. 
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS
+ * OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT,
+ * INDIRECT,  INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Host build: small subset of stm32 peripheral library
+ * used by application, backed by simulated devices
+ * in host directory.
+ */
+
+#ifndef _HOST_SIM_H
+#define _HOST_SIM_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+typedef enum { RESET = 0, SET = !RESET } FlagStatus, ITStatus;
+typedef enum { DISABLE = 0, ENABLE = !DISABLE } FunctionalState;
+typedef enum { Bit_RESET = 0, Bit_SET } BitAction;
+typedef enum { ERROR = 0, SUCCESS = !ERROR } ErrorStatus;
+
+/*
+ * GPIO. Pins just hold their state, input data
+ * of pins configured as input can be set by simulators.
+ */
+typedef struct {
+
+  uint16_t odr;
+  uint16_t idr;
+  uint16_t input;
+} GPIO_TypeDef;
+
+extern GPIO_TypeDef simGpio[3];
+
+#define GPIOA (&simGpio[0])
+#define GPIOB (&simGpio[1])
+#define GPIOC (&simGpio[2])
+
+#define GPIO_Pin_0  0x0001
+#define GPIO_Pin_1  0x0002
+#define GPIO_Pin_2  0x0004
+#define GPIO_Pin_3  0x0008
+#define GPIO_Pin_4  0x0010
+#define GPIO_Pin_5  0x0020
+#define GPIO_Pin_6  0x0040
+#define GPIO_Pin_7  0x0080
+#define GPIO_Pin_8  0x0100
+#define GPIO_Pin_9  0x0200
+#define GPIO_Pin_10 0x0400
+#define GPIO_Pin_11 0x0800
+#define GPIO_Pin_12 0x1000
+#define GPIO_Pin_13 0x2000
+#define GPIO_Pin_14 0x4000
+#define GPIO_Pin_15 0x8000
+
+typedef enum { GPIO_Mode_IN, GPIO_Mode_OUT, GPIO_Mode_AF, GPIO_Mode_AN } GPIOMode_TypeDef;
+typedef enum { GPIO_OType_PP, GPIO_OType_OD } GPIOOType_TypeDef;
+typedef enum { GPIO_PuPd_NOPULL, GPIO_PuPd_UP, GPIO_PuPd_DOWN } GPIOPuPd_TypeDef;
+typedef enum { GPIO_Speed_2MHz, GPIO_Speed_25MHz, GPIO_Speed_50MHz, GPIO_Speed_100MHz } GPIOSpeed_TypeDef;
+
+typedef struct {
+
+  uint32_t          GPIO_Pin;
+  GPIOMode_TypeDef  GPIO_Mode;
+  GPIOSpeed_TypeDef GPIO_Speed;
+  GPIOOType_TypeDef GPIO_OType;
+  GPIOPuPd_TypeDef  GPIO_PuPd;
+} GPIO_InitTypeDef;
+
+void     GPIO_Init(GPIO_TypeDef* port, GPIO_InitTypeDef* init);
+uint16_t GPIO_ReadInputData(GPIO_TypeDef* port);
+uint8_t  GPIO_ReadInputDataBit(GPIO_TypeDef* port, uint16_t pin);
+void     GPIO_SetBits(GPIO_TypeDef* port, uint16_t pins);
+void     GPIO_ResetBits(GPIO_TypeDef* port, uint16_t pins);
+void     GPIO_WriteBit(GPIO_TypeDef* port, uint16_t pin, BitAction value);
+
+static inline void GPIO_PinAFConfig(GPIO_TypeDef* port, uint16_t source, uint8_t af) {}
+
+/*
+ * Clocks, power and reset.
+ */
+#define RCC_AHB1Periph_GPIOA  0x01
+#define RCC_AHB1Periph_GPIOB  0x02
+#define RCC_AHB1Periph_GPIOC  0x04
+#define RCC_APB1Periph_PWR    0x10000000
+#define RCC_APB2Periph_ADC1   0x00000100
+#define RCC_APB2Periph_SPI1   0x00001000
+#define RCC_FLAG_IWDGRST      0x7D
+
+static inline void RCC_AHB1PeriphClockCmd(uint32_t periph, FunctionalState state) {}
+static inline void RCC_APB1PeriphClockCmd(uint32_t periph, FunctionalState state) {}
+static inline void RCC_APB2PeriphClockCmd(uint32_t periph, FunctionalState state) {}
+FlagStatus RCC_GetFlagStatus(uint8_t flag);
+void       RCC_ClearFlag(void);
+
+typedef struct {
+
+  uint32_t CR;
+} PWR_TypeDef;
+
+typedef struct {
+
+  uint32_t SCR;
+} SCB_Type;
+
+typedef struct {
+
+  uint32_t VAL;
+} SysTick_Type;
+
+extern PWR_TypeDef  simPwr;
+extern SCB_Type     simScb;
+extern SysTick_Type simSysTick;
+
+#define PWR     (&simPwr)
+#define SCB     (&simScb)
+#define SysTick (&simSysTick)
+
+#define PWR_CR_LPDS              0x0001
+#define PWR_CR_PDDS              0x0002
+#define PWR_FLAG_WU              0x0001
+#define SCB_SCR_SLEEPDEEP_Msk    0x0004
+
+static inline FlagStatus PWR_GetFlagStatus(uint32_t flag) { return RESET; }
+static inline void PWR_FlashPowerDownCmd(FunctionalState state) {}
+static inline void PWR_BackupAccessCmd(FunctionalState state) {}
+
+typedef struct {
+
+  uint8_t RTC_Hours;
+  uint8_t RTC_Minutes;
+  uint8_t RTC_Seconds;
+  uint8_t RTC_H12;
+} RTC_TimeTypeDef;
+
+typedef struct {
+
+  uint8_t RTC_WeekDay;
+  uint8_t RTC_Month;
+  uint8_t RTC_Date;
+  uint8_t RTC_Year;
+} RTC_DateTypeDef;
+
+#define RTC_Format_BIN 0
+#define RTC_H12_AM     0
+#define RTC_BKP_DR0    0
+#define RTC_BKP_DR1    1
+#define RTC_BKP_DR2    2
+
+ErrorStatus RTC_SetTime(uint32_t format, RTC_TimeTypeDef* time);
+ErrorStatus RTC_SetDate(uint32_t format, RTC_DateTypeDef* date);
+void        RTC_GetTime(uint32_t format, RTC_TimeTypeDef* time);
+void        RTC_GetDate(uint32_t format, RTC_DateTypeDef* date);
+ErrorStatus RTC_WaitForSynchro(void);
+void        RTC_WriteBackupRegister(uint32_t reg, uint32_t data);
+uint32_t    RTC_ReadBackupRegister(uint32_t reg);
+
+/*
+ * Cycle counter follows process cpu time.
+ */
+typedef struct {
+
+  uint32_t CTRL;
+  uint32_t CYCCNT;
+} DWT_Type;
+
+typedef struct {
+
+  uint32_t DEMCR;
+} CoreDebug_Type;
+
+extern CoreDebug_Type simCoreDebug;
+extern uint32_t       SystemCoreClock;
+
+DWT_Type* simDwt(void);
+
+#define DWT       (simDwt())
+#define CoreDebug (&simCoreDebug)
+
+#define DWT_CTRL_CYCCNTENA_Msk     0x0001
+#define CoreDebug_DEMCR_TRCENA_Msk 0x01000000
+
+void NVIC_SystemReset(void);
+
+/*
+ * Independent watchdog.
+ */
+#define IWDG_WriteAccess_Enable  0x5555
+#define IWDG_Prescaler_256       0x06
+#define DBGMCU_IWDG_STOP         0x1000
+
+static inline void IWDG_WriteAccessCmd(uint16_t access) {}
+static inline void IWDG_SetPrescaler(uint8_t prescaler) {}
+static inline void IWDG_SetReload(uint16_t reload) {}
+static inline void DBGMCU_APB1PeriphConfig(uint32_t periph, FunctionalState state) {}
+void IWDG_Enable(void);
+void IWDG_ReloadCounter(void);
+
+/*
+ * ADC. Conversion result comes from simulated battery.
+ */
+typedef struct {
+
+  bool     enabled;
+  bool     dma;
+  uint32_t DR;
+} ADC_TypeDef;
+
+extern ADC_TypeDef simAdc1;
+
+#define ADC1 (&simAdc1)
+
+typedef struct {
+
+  uint32_t ADC_Mode;
+  uint32_t ADC_Prescaler;
+  uint32_t ADC_DMAAccessMode;
+  uint32_t ADC_TwoSamplingDelay;
+} ADC_CommonInitTypeDef;
+
+typedef struct {
+
+  uint32_t        ADC_Resolution;
+  FunctionalState ADC_ScanConvMode;
+  FunctionalState ADC_ContinuousConvMode;
+  uint32_t        ADC_ExternalTrigConvEdge;
+  uint32_t        ADC_ExternalTrigConv;
+  uint32_t        ADC_DataAlign;
+  uint8_t         ADC_NbrOfConversion;
+} ADC_InitTypeDef;
+
+#define ADC_Mode_Independent              0
+#define ADC_DMAAccessMode_Disabled        0
+#define ADC_Prescaler_Div2                0
+#define ADC_TwoSamplingDelay_5Cycles      0
+#define ADC_Resolution_12b                0
+#define ADC_Resolution_8b                 2
+#define ADC_ExternalTrigConvEdge_None     0
+#define ADC_DataAlign_Right               0
+#define ADC_Channel_5                     5
+#define ADC_SampleTime_480Cycles          7
+#define ADC_FLAG_EOC                      0x02
+#define ADC_FLAG_OVR                      0x20
+
+static inline void ADC_CommonStructInit(ADC_CommonInitTypeDef* init) {}
+static inline void ADC_CommonInit(ADC_CommonInitTypeDef* init) {}
+static inline void ADC_StructInit(ADC_InitTypeDef* init) {}
+static inline void ADC_RegularChannelConfig(ADC_TypeDef* adc, uint8_t channel, uint8_t rank, uint8_t sampleTime) {}
+static inline void ADC_DMARequestAfterLastTransferCmd(ADC_TypeDef* adc, FunctionalState state) {}
+static inline void ADC_ClearFlag(ADC_TypeDef* adc, uint8_t flags) {}
+
+void ADC_Init(ADC_TypeDef* adc, ADC_InitTypeDef* init);
+void ADC_Cmd(ADC_TypeDef* adc, FunctionalState state);
+void ADC_DMACmd(ADC_TypeDef* adc, FunctionalState state);
+void ADC_SoftwareStartConv(ADC_TypeDef* adc);
+
+/*
+ * DMA stream transfers battery samples from simulated ADC.
+ */
+typedef struct {
+
+  bool      enabled;
+  bool      tcInterrupt;
+  bool      tc;
+  uint16_t* base;
+  uint16_t* memory;
+  uint16_t  count;
+} DMA_Stream_TypeDef;
+
+extern DMA_Stream_TypeDef simDma2Stream0;
+
+#define DMA2_Stream0 (&simDma2Stream0)
+
+typedef struct {
+
+  uint32_t  DMA_Channel;
+  uintptr_t DMA_PeripheralBaseAddr;
+  uintptr_t DMA_Memory0BaseAddr;
+  uint32_t  DMA_DIR;
+  uint32_t  DMA_BufferSize;
+  uint32_t  DMA_PeripheralInc;
+  uint32_t  DMA_MemoryInc;
+  uint32_t  DMA_PeripheralDataSize;
+  uint32_t  DMA_MemoryDataSize;
+  uint32_t  DMA_Mode;
+  uint32_t  DMA_Priority;
+  uint32_t  DMA_FIFOMode;
+  uint32_t  DMA_FIFOThreshold;
+  uint32_t  DMA_MemoryBurst;
+  uint32_t  DMA_PeripheralBurst;
+} DMA_InitTypeDef;
+
+#define RCC_AHB1Periph_DMA2               0x00400000
+#define DMA_Channel_0                     0
+#define DMA_DIR_PeripheralToMemory        0
+#define DMA_PeripheralInc_Disable         0
+#define DMA_MemoryInc_Enable              0x0400
+#define DMA_PeripheralDataSize_HalfWord   0x0800
+#define DMA_MemoryDataSize_HalfWord       0x2000
+#define DMA_Mode_Normal                   0
+#define DMA_Priority_Low                  0
+#define DMA_FIFOMode_Disable              0
+#define DMA_IT_TC                         0x10
+#define DMA_IT_TCIF0                      0x10008020
+#define DMA_FLAG_FEIF0                    0x10800001
+#define DMA_FLAG_DMEIF0                   0x10800004
+#define DMA_FLAG_TEIF0                    0x10000008
+#define DMA_FLAG_HTIF0                    0x10000010
+#define DMA_FLAG_TCIF0                    0x10000020
+
+static inline void DMA_DeInit(DMA_Stream_TypeDef* stream) {}
+static inline void DMA_StructInit(DMA_InitTypeDef* init) {}
+
+void            DMA_Init(DMA_Stream_TypeDef* stream, DMA_InitTypeDef* init);
+void            DMA_Cmd(DMA_Stream_TypeDef* stream, FunctionalState state);
+FunctionalState DMA_GetCmdStatus(DMA_Stream_TypeDef* stream);
+void            DMA_SetCurrDataCounter(DMA_Stream_TypeDef* stream, uint16_t count);
+void            DMA_ITConfig(DMA_Stream_TypeDef* stream, uint32_t it, FunctionalState state);
+ITStatus        DMA_GetITStatus(DMA_Stream_TypeDef* stream, uint32_t it);
+void            DMA_ClearITPendingBit(DMA_Stream_TypeDef* stream, uint32_t it);
+void            DMA_ClearFlag(DMA_Stream_TypeDef* stream, uint32_t flags);
+
+void DMA2_Stream0_irq(void);
+
+#define DMA2_Stream0_IRQn 56
+
+typedef struct {
+
+  uint8_t         NVIC_IRQChannel;
+  uint8_t         NVIC_IRQChannelPreemptionPriority;
+  uint8_t         NVIC_IRQChannelSubPriority;
+  FunctionalState NVIC_IRQChannelCmd;
+} NVIC_InitTypeDef;
+
+static inline void NVIC_Init(NVIC_InitTypeDef* init) {}
+
+typedef struct {
+
+  int unused;
+} SPI_TypeDef;
+
+extern SPI_TypeDef simSpi1;
+
+#define SPI1 (&simSpi1)
+
+/*
+ * Report 1-wire bus usage after measurement cycle.
+ */
+void owSimCycle(void);
+
+#endif
@@ -0,0 +1,128 @@
+/*
+ * Copyright (c) 2019, Ari Suutari <ari@stonepile.fi>.
+ * All rights reserved. 
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 
+ *  1. Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *  3. The name of the author may not be used to endorse or promote
+ *     products derived from this software without specific prior written
+ *     permission. 
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS
+ * OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT,
+ * INDIRECT,  INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Host build: wifi driver API used by application.
+ * Radio is simulated in host/wifi.c, network traffic
+ * goes through a tap interface.
+ */
+
+#ifndef _HOST_WICED_DRIVER_H
+#define _HOST_WICED_DRIVER_H
+
+#include <stdint.h>
+#include "lwip/netif.h"
+
+#define WICED_SDK_VERSION "host"
+
+typedef enum {
+
+  WWD_SUCCESS = 0,
+  WWD_PENDING = 1,
+  WWD_TIMEOUT = 2,
+  WWD_NOT_UP  = 1005
+} wwd_result_t;
+
+typedef enum {
+
+  WWD_STA_INTERFACE = 0,
+  WWD_AP_INTERFACE  = 1
+} wwd_interface_t;
+
+typedef enum {
+
+  WICED_SECURITY_OPEN,
+  WICED_SECURITY_WPA2_AES_PSK,
+  WICED_SECURITY_WPA2_MIXED_PSK
+} wiced_security_t;
+
+#define WICED_COUNTRY_FINLAND 0x4946
+
+typedef struct {
+
+  uint8_t octet[6];
+} wiced_mac_t;
+
+typedef struct {
+
+  uint8_t length;
+  uint8_t value[32];
+} wiced_ssid_t;
+
+typedef enum {
+
+  WICED_BSS_TYPE_INFRASTRUCTURE = 0,
+  WICED_BSS_TYPE_ADHOC          = 1
+} wiced_bss_type_t;
+
+typedef enum {
+
+  WICED_802_11_BAND_5GHZ   = 0,
+  WICED_802_11_BAND_2_4GHZ = 1
+} wiced_802_11_band_t;
+
+typedef struct {
+
+  wiced_ssid_t        SSID;
+  wiced_mac_t         BSSID;
+  int16_t             signal_strength;
+  uint32_t            max_data_rate;
+  wiced_bss_type_t    bss_type;
+  wiced_security_t    security;
+  uint8_t             channel;
+  wiced_802_11_band_t band;
+} wiced_scan_result_t;
+
+#define WSEC_MAX_PSK_LEN 64
+
+typedef void* host_semaphore_type_t;
+
+wwd_result_t wwd_management_wifi_on(uint32_t country);
+wwd_result_t wwd_management_wifi_off(void);
+wwd_result_t wwd_wifi_set_up(void);
+wwd_result_t wwd_wifi_set_down(void);
+wwd_result_t wwd_wifi_join(const wiced_ssid_t* ssid, wiced_security_t security,
+                           const uint8_t* key, uint8_t keyLength,
+                           host_semaphore_type_t* semaphore, wwd_interface_t interface);
+wwd_result_t wwd_wifi_join_specific(const wiced_scan_result_t* ap, const uint8_t* key, uint8_t keyLength,
+                                    host_semaphore_type_t* semaphore, wwd_interface_t interface);
+wwd_result_t wwd_wifi_leave(wwd_interface_t interface);
+wwd_result_t wwd_wifi_get_bssid(wiced_mac_t* bssid);
+wwd_result_t wwd_wifi_get_channel(wwd_interface_t interface, uint32_t* channel);
+wwd_result_t wwd_wifi_get_pmk(const char* psk, uint8_t pskLength, char* pmk);
+wwd_result_t wwd_wifi_get_mac_address(wiced_mac_t* mac, wwd_interface_t interface);
+wwd_result_t wwd_wifi_is_ready_to_transceive(wwd_interface_t interface);
+wwd_result_t wwd_wifi_get_rssi(int32_t* rssi);
+wwd_result_t wwd_wifi_get_noise(int32_t* noise);
+wwd_result_t wwd_buffer_init(void* arg);
+
+err_t ethernetif_init(struct netif* netif);
+
+#endif
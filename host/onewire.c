@@ -0,0 +1,774 @@
+/*
+ * Copyright (c) 2019, Ari Suutari <ari@stonepile.fi>.
+ * All rights reserved. 
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 
+ *  1. Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *  3. The name of the author may not be used to endorse or promote
+ *     products derived from this software without specific prior written
+ *     permission. 
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS
+ * OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT,
+ * INDIRECT,  INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Simulated 1-wire bus for host build. Line is open-drain
+ * with a pull-up: master drives it low through OWCFG_*
+ * macros, and DS18B20 models on the bus pull it low
+ * when they send a zero bit.
+ *
+ * Link layer functions of picoos-ow are replaced with
+ * linker --wrap, so that time slots reach the bus model
+ * directly and results don't depend on host load. Pin
+ * level access is decoded from the length of the low
+ * pulse master generates: short pulse is a write 1 or
+ * read slot, longer one is write 0 and a very long one
+ * is reset. Bus time is accounted using nominal standard
+ * speed slot lengths.
+ */
+
+#include <picoos.h>
+#include <picoos-u.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <time.h>
+#include <eshell.h>
+#include <picoos-ow.h>
+
+#include "emw-sensor.h"
+
+#define OWSIM_MAX_DEVICES MAX_SENSORS_LIMIT
+
+/*
+ * Low pulse limits for slot decoding, microseconds.
+ */
+#define LOW_ZERO_US  30
+#define LOW_RESET_US 240
+
+/*
+ * Nominal bus time used by reset & presence and
+ * a single time slot, microseconds.
+ */
+#define RESET_US 960
+#define SLOT_US  70
+
+#define DEFAULT_CONVERT_MS 750
+#define DEFAULT_DEVICES    2
+
+#define ROM_READ     0x33
+#define ROM_MATCH    0x55
+#define ROM_SKIP     0xCC
+#define ROM_SEARCH   0xF0
+
+#define FN_CONVERT   0x44
+#define FN_READ_PAD  0xBE
+#define FN_WRITE_PAD 0x4E
+#define FN_COPY_PAD  0x48
+#define FN_RECALL    0xB8
+
+typedef enum {
+
+  DEV_IDLE,      // not selected, waits for reset
+  DEV_ROM,       // receiving rom command
+  DEV_SEARCH,    // taking part in rom search
+  DEV_MATCH,     // receiving rom for match
+  DEV_FUNCTION,  // receiving function command
+  DEV_WRITE_PAD, // receiving scratchpad bytes
+  DEV_SEND,      // sending rom or scratchpad
+  DEV_CONVERT    // converting temperature
+} DevState;
+
+typedef struct {
+
+  uint8_t  rom[8];
+  bool     online;
+  int16_t  temp;        // measured temperature, 1/16 C
+  uint8_t  pad[9];
+  uint8_t  eeprom[3];   // TH, TL, configuration
+  uint32_t convertDone; // ms, 0 if not converting
+
+  DevState state;
+  DevState next;        // state after send is complete
+  int      bit;
+  int      phase;       // rom search: bit, complement, direction
+  uint8_t  byte;
+  uint8_t  data[9];
+  int      len;         // bits to send
+} SimDevice;
+
+typedef struct {
+
+  int      resets;
+  int      zeroSlots;
+  int      oneSlots;
+  int      samples;
+  int      conversions;
+  int      crcFaults;
+  uint32_t busUs;
+} SimStats;
+
+static SimDevice devices[OWSIM_MAX_DEVICES];
+static int       deviceCount;
+static bool      busReady;
+
+static bool      driveLow;
+static int       line = 1;
+static struct timespec lowStart;
+
+static int       convertMs = DEFAULT_CONVERT_MS;
+static int       crcPercent;
+static int       flapPercent;
+static uint32_t  seed = 1;
+
+static SimStats  cycle;
+static SimStats  lastCycle;
+static SimStats  total;
+static int       cycles;
+
+/*
+ * Deterministic pseudo-random numbers, so that
+ * benchmark runs can be repeated.
+ */
+static uint32_t simRandom()
+{
+  seed ^= seed << 13;
+  seed ^= seed >> 17;
+  seed ^= seed << 5;
+  return seed;
+}
+
+static bool chance(int percent)
+{
+  return percent > 0 && (int)(simRandom() % 100) < percent;
+}
+
+static uint32_t nowMs()
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static uint8_t crc8(const uint8_t* data, int len)
+{
+  uint8_t crc = 0;
+  int     i;
+
+  while (len--) {
+
+    crc ^= *data++;
+    for (i = 0; i < 8; i++)
+      crc = (crc & 1) ? (crc >> 1) ^ 0x8C : crc >> 1;
+  }
+
+  return crc;
+}
+
+static int resolution(const SimDevice* d)
+{
+  return 9 + ((d->pad[4] >> 5) & 3);
+}
+
+static void deviceInit(SimDevice* d, const uint8_t* addr)
+{
+  memset(d, '\0', sizeof(SimDevice));
+  memcpy(d->rom, addr, 7);
+  d->rom[7] = crc8(d->rom, 7);
+  d->online = true;
+  d->temp   = 20 * 16 + (d - devices) * 4;
+
+  // Power-on values of DS18B20.
+  d->eeprom[0] = 0x4B;
+  d->eeprom[1] = 0x46;
+  d->eeprom[2] = 0x7F;
+
+  d->pad[0] = 0x50;
+  d->pad[1] = 0x05;
+  memcpy(d->pad + 2, d->eeprom, 3);
+  d->pad[5] = 0xFF;
+  d->pad[6] = 0x0C;
+  d->pad[7] = 0x10;
+}
+
+static SimDevice* deviceAdd(const uint8_t* addr)
+{
+  if (deviceCount >= OWSIM_MAX_DEVICES)
+    return NULL;
+
+  deviceInit(&devices[deviceCount], addr);
+  return &devices[deviceCount++];
+}
+
+static SimDevice* deviceFind(const uint8_t* addr)
+{
+  int i;
+
+  for (i = 0; i < deviceCount; i++)
+    if (!memcmp(devices[i].rom, addr, 7))
+      return &devices[i];
+
+  return NULL;
+}
+
+/*
+ * Populate bus with generated DS18B20 devices.
+ */
+static void generate(int count)
+{
+  uint8_t addr[7];
+  int     i;
+
+  deviceCount = 0;
+  while (count-- > 0) {
+
+    addr[0] = 0x28;
+    for (i = 1; i < 7; i++)
+      addr[i] = simRandom();
+
+    deviceAdd(addr);
+  }
+}
+
+static void busInit()
+{
+  const char* env = getenv("EMW_SENSORS");
+
+  busReady = true;
+  generate(env ? atoi(env) : DEFAULT_DEVICES);
+}
+
+/*
+ * Complete conversion if it has had enough time.
+ */
+static void convertCheck(SimDevice* d)
+{
+  int16_t mask;
+
+  if (d->convertDone == 0 || (int32_t)(nowMs() - d->convertDone) < 0)
+    return;
+
+  mask = ~((1 << (12 - resolution(d))) - 1);
+  d->pad[0] = (d->temp & mask) & 0xFF;
+  d->pad[1] = (d->temp & mask) >> 8;
+  d->convertDone = 0;
+}
+
+static void send(SimDevice* d, const uint8_t* data, int bytes, DevState next)
+{
+  memcpy(d->data, data, bytes);
+  d->len   = bytes * 8;
+  d->bit   = 0;
+  d->state = DEV_SEND;
+  d->next  = next;
+}
+
+static int romBit(const SimDevice* d)
+{
+  return (d->rom[d->bit / 8] >> (d->bit % 8)) & 1;
+}
+
+/*
+ * Bit device places on bus during time slot.
+ */
+static int deviceOut(SimDevice* d)
+{
+  switch (d->state) {
+  case DEV_SEARCH:
+    if (d->phase == 2)
+      return 1;
+
+    return romBit(d) ^ d->phase;
+
+  case DEV_SEND:
+    if (d->bit >= d->len)
+      return 1;
+
+    return (d->data[d->bit / 8] >> (d->bit % 8)) & 1;
+
+  case DEV_CONVERT:
+    convertCheck(d);
+    return d->convertDone == 0;
+
+  default:
+    return 1;
+  }
+}
+
+static void romCommand(SimDevice* d)
+{
+  switch (d->byte) {
+  case ROM_READ:
+    send(d, d->rom, 8, DEV_FUNCTION);
+    break;
+
+  case ROM_MATCH:
+    d->state = DEV_MATCH;
+    break;
+
+  case ROM_SKIP:
+    d->state = DEV_FUNCTION;
+    break;
+
+  case ROM_SEARCH:
+    d->state = DEV_SEARCH;
+    d->phase = 0;
+    break;
+
+  default:
+    d->state = DEV_IDLE;
+    break;
+  }
+
+  d->bit = 0;
+}
+
+static void functionCommand(SimDevice* d)
+{
+  uint8_t pad[9];
+
+  d->bit = 0;
+  switch (d->byte) {
+  case FN_CONVERT:
+    d->state = DEV_CONVERT;
+    d->convertDone = nowMs() + (convertMs >> (12 - resolution(d)));
+    if (d->convertDone == 0)
+      d->convertDone = 1;
+
+    ++cycle.conversions;
+    break;
+
+  case FN_READ_PAD:
+    convertCheck(d);
+    memcpy(pad, d->pad, 8);
+    pad[8] = crc8(pad, 8);
+    if (chance(crcPercent)) {
+
+      pad[8] ^= 1 << (simRandom() % 8);
+      ++cycle.crcFaults;
+    }
+
+    send(d, pad, 9, DEV_IDLE);
+    break;
+
+  case FN_WRITE_PAD:
+    d->state = DEV_WRITE_PAD;
+    break;
+
+  case FN_COPY_PAD:
+    memcpy(d->eeprom, d->pad + 2, 3);
+    d->state = DEV_IDLE;
+    break;
+
+  case FN_RECALL:
+    memcpy(d->pad + 2, d->eeprom, 3);
+    d->state = DEV_IDLE;
+    break;
+
+  default:
+    d->state = DEV_IDLE;
+    break;
+  }
+}
+
+/*
+ * Process bus level at end of time slot.
+ */
+static void deviceIn(SimDevice* d, int v)
+{
+  switch (d->state) {
+  case DEV_ROM:
+  case DEV_FUNCTION:
+    d->byte = (d->byte >> 1) | (v << 7);
+    if (++d->bit < 8)
+      break;
+
+    if (d->state == DEV_ROM)
+      romCommand(d);
+    else
+      functionCommand(d);
+
+    break;
+
+  case DEV_SEARCH:
+    if (d->phase < 2) {
+
+      ++d->phase;
+      break;
+    }
+
+    d->phase = 0;
+    if (v != romBit(d))
+      d->state = DEV_IDLE;
+    else if (++d->bit == 64)
+      d->state = DEV_FUNCTION;
+
+    if (d->state != DEV_SEARCH)
+      d->bit = 0;
+
+    break;
+
+  case DEV_MATCH:
+    if (v != romBit(d))
+      d->state = DEV_IDLE;
+    else if (++d->bit == 64)
+      d->state = DEV_FUNCTION;
+
+    if (d->state != DEV_MATCH)
+      d->bit = 0;
+
+    break;
+
+  case DEV_WRITE_PAD:
+    d->byte = (d->byte >> 1) | (v << 7);
+    if (++d->bit % 8)
+      break;
+
+    d->pad[1 + d->bit / 8] = d->byte;
+    if (d->bit == 24) {
+
+      d->pad[4] |= 0x1F;
+      d->state = DEV_IDLE;
+    }
+
+    break;
+
+  case DEV_SEND:
+    if (++d->bit == d->len) {
+
+      d->state = d->next;
+      d->bit = 0;
+    }
+
+    break;
+
+  default:
+    break;
+  }
+}
+
+static void busReset()
+{
+  SimDevice* d;
+  int        i;
+
+  line = 1;
+  for (i = 0, d = devices; i < deviceCount; i++, d++) {
+
+    if (!d->online)
+      continue;
+
+    convertCheck(d);
+    d->state = DEV_ROM;
+    d->bit   = 0;
+    line = 0; // presence pulse
+  }
+
+  ++cycle.resets;
+  cycle.busUs += RESET_US;
+}
+
+static void busSlot(int master)
+{
+  SimDevice* d;
+  int        i;
+
+  line = master;
+  for (i = 0, d = devices; i < deviceCount; i++, d++)
+    if (d->online)
+      line &= deviceOut(d);
+
+  for (i = 0, d = devices; i < deviceCount; i++, d++)
+    if (d->online)
+      deviceIn(d, line);
+
+  if (master)
+    ++cycle.oneSlots;
+  else
+    ++cycle.zeroSlots;
+
+  cycle.busUs += SLOT_US;
+}
+
+static void release()
+{
+  struct timespec ts;
+  long            us;
+
+  if (!driveLow)
+    return;
+
+  driveLow = false;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  us = (ts.tv_sec - lowStart.tv_sec) * 1000000 + (ts.tv_nsec - lowStart.tv_nsec) / 1000;
+
+  if (us >= LOW_RESET_US)
+    busReset();
+  else
+    busSlot(us < LOW_ZERO_US);
+}
+
+void owSimLow()
+{
+  if (!busReady)
+    busInit();
+
+  if (driveLow)
+    return;
+
+  driveLow = true;
+  clock_gettime(CLOCK_MONOTONIC, &lowStart);
+}
+
+void owSimHigh()
+{
+  release();
+}
+
+void owSimRelease()
+{
+  release();
+}
+
+int owSimRead()
+{
+  ++cycle.samples;
+  return driveLow ? 0 : line;
+}
+
+/*
+ * Link layer of picoos-ow.
+ */
+SMALLINT __wrap_owTouchReset(int portnum)
+{
+  if (!busReady)
+    busInit();
+
+  busReset();
+  return line == 0;
+}
+
+SMALLINT __wrap_owTouchBit(int portnum, SMALLINT sendbit)
+{
+  if (!busReady)
+    busInit();
+
+  busSlot(sendbit & 1);
+  ++cycle.samples;
+  return line;
+}
+
+SMALLINT __wrap_owTouchByte(int portnum, SMALLINT sendbyte)
+{
+  SMALLINT result = 0;
+  int      i;
+
+  for (i = 0; i < 8; i++)
+    result |= __wrap_owTouchBit(portnum, (sendbyte >> i) & 1) << i;
+
+  return result;
+}
+
+SMALLINT __wrap_owWriteByte(int portnum, SMALLINT sendbyte)
+{
+  return __wrap_owTouchByte(portnum, sendbyte) == (sendbyte & 0xFF);
+}
+
+SMALLINT __wrap_owReadByte(int portnum)
+{
+  return __wrap_owTouchByte(portnum, 0xFF);
+}
+
+/*
+ * Strong pull-up is not modeled, simulated
+ * devices are externally powered.
+ */
+SMALLINT __wrap_owWriteBytePower(int portnum, SMALLINT sendbyte)
+{
+  return __wrap_owWriteByte(portnum, sendbyte);
+}
+
+SMALLINT __wrap_owReadBitPower(int portnum, SMALLINT applyPowerResponse)
+{
+  return __wrap_owTouchBit(portnum, 1);
+}
+
+static void addStats(SimStats* sum, const SimStats* s)
+{
+  sum->resets      += s->resets;
+  sum->zeroSlots   += s->zeroSlots;
+  sum->oneSlots    += s->oneSlots;
+  sum->samples     += s->samples;
+  sum->conversions += s->conversions;
+  sum->crcFaults   += s->crcFaults;
+  sum->busUs       += s->busUs;
+}
+
+static void printStats(EshContext* ctx, const char* title, const SimStats* s)
+{
+  eshPrintf(ctx, "%s: %d resets, %d slots (%d zero), %d samples, %d conversions, %d crc faults, bus time %lu.%03lu ms.\n",
+                 title,
+                 s->resets,
+                 s->zeroSlots + s->oneSlots,
+                 s->zeroSlots,
+                 s->samples,
+                 s->conversions,
+                 s->crcFaults,
+                 (unsigned long)s->busUs / 1000,
+                 (unsigned long)s->busUs % 1000);
+}
+
+/*
+ * Called by sensorThread after each measurement cycle.
+ * Reports bus usage of cycle and lets devices appear
+ * or disappear.
+ */
+void owSimCycle()
+{
+  int i;
+
+  lastCycle = cycle;
+  addStats(&total, &cycle);
+  memset(&cycle, '\0', sizeof(cycle));
+  ++cycles;
+
+  printf("owsim: cycle %d, %d resets, %d slots, bus time %lu.%03lu ms\n",
+         cycles,
+         lastCycle.resets,
+         lastCycle.zeroSlots + lastCycle.oneSlots,
+         (unsigned long)lastCycle.busUs / 1000,
+         (unsigned long)lastCycle.busUs % 1000);
+
+  for (i = 0; i < deviceCount; i++) {
+
+    if (chance(flapPercent)) {
+
+      devices[i].online = !devices[i].online;
+      devices[i].state  = DEV_IDLE;
+    }
+  }
+}
+
+/*
+ * Configure simulated bus.
+ */
+static int owsim(EshContext* ctx)
+{
+  char* count   = eshNamedArg(ctx, "devices", false);
+  char* address = eshNamedArg(ctx, "address", false);
+  char* online  = eshNamedArg(ctx, "online", false);
+  char* temp    = eshNamedArg(ctx, "temp", false);
+  char* convert = eshNamedArg(ctx, "convert", false);
+  char* crc     = eshNamedArg(ctx, "crc", false);
+  char* flap    = eshNamedArg(ctx, "flap", false);
+  char* rseed   = eshNamedArg(ctx, "seed", false);
+  char* clear   = eshNamedArg(ctx, "clear", false);
+
+  eshCheckNamedArgsUsed(ctx);
+  eshCheckArgsUsed(ctx);
+  if (eshArgError(ctx) != EshOK)
+    return -1;
+
+  if (!busReady)
+    busInit();
+
+  if (rseed) {
+
+    seed = strtoul(rseed, NULL, 10);
+    if (seed == 0)
+      seed = 1;
+  }
+
+  if (count)
+    generate(atoi(count));
+
+  if (address) {
+
+    uint8_t    addr[7];
+    SimDevice* d;
+
+    owStr2Addr(addr, address);
+    d = deviceFind(addr);
+    if (d == NULL)
+      d = deviceAdd(addr);
+
+    if (d == NULL) {
+
+      eshPrintf(ctx, "Too many devices.\n");
+      return -1;
+    }
+
+    if (online) {
+
+      d->online = !strcmp(online, "yes");
+      d->state  = DEV_IDLE;
+    }
+
+    if (temp)
+      d->temp = atof(temp) * 16;
+  }
+
+  if (convert)
+    convertMs = atoi(convert);
+
+  if (crc)
+    crcPercent = atoi(crc);
+
+  if (flap)
+    flapPercent = atoi(flap);
+
+  if (clear) {
+
+    memset(&total, '\0', sizeof(total));
+    cycles = 0;
+  }
+
+  char serialStr[20];
+  int  i;
+
+  for (i = 0; i < deviceCount; i++) {
+
+    owAddr2Str(serialStr, devices[i].rom);
+    eshPrintf(ctx, "%s %.2f C %d bits%s\n",
+                   serialStr,
+                   devices[i].temp / 16.0,
+                   resolution(&devices[i]),
+                   devices[i].online ? "" : " (offline)");
+  }
+
+  eshPrintf(ctx, "Conversion %d ms, crc faults %d%%, flapping %d%%.\n", convertMs, crcPercent, flapPercent);
+  printStats(ctx, "Last cycle", &lastCycle);
+  printStats(ctx, "Total", &total);
+  eshPrintf(ctx, "Cycles: %d\n", cycles);
+  return 0;
+}
+
+const EshCommand owsimCommand = {
+  .flags = 0,
+  .name = "owsim",
+  .help = "show simulated onewire bus, set number of devices (--devices=)\n"
+          "add or change device (--address=,--online=yes|no,--temp=)\n"
+          "set 12-bit conversion time (--convert=ms)\n"
+          "inject faults (--crc=percent,--flap=percent,--seed=)\n"
+          "clear totals (--clear)",
+  .handler = owsim
+};
@@ -0,0 +1,254 @@
+/*
+ * Copyright (c) 2019, Ari Suutari <ari@stonepile.fi>.
+ * All rights reserved. 
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 
+ *  1. Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *  3. The name of the author may not be used to endorse or promote
+ *     products derived from this software without specific prior written
+ *     permission. 
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS
+ * OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT,
+ * INDIRECT,  INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Simulated MX25L1606E spi flash for host build.
+ * Flash contents are kept in a file (emw-flash.img, or
+ * EMW_FLASH environment variable) which is mapped to memory.
+ * Access to flash while it is in deep powerdown is reported.
+ */
+
+#include <picoos.h>
+#include <picoos-u.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+
+#include "devtree.h"
+
+#define FLASH_SIZE (2 * 1024 * 1024)
+#define PAGE_SIZE  256
+
+#define CMD_WRSR  0x01
+#define CMD_PP    0x02
+#define CMD_READ  0x03
+#define CMD_WRDI  0x04
+#define CMD_RDSR  0x05
+#define CMD_WREN  0x06
+#define CMD_FREAD 0x0B
+#define CMD_SE    0x20
+#define CMD_BE32  0x52
+#define CMD_CE    0x60
+#define CMD_RDID  0x9F
+#define CMD_RES   0xAB
+#define CMD_DP    0xB9
+#define CMD_CE2   0xC7
+#define CMD_BE    0xD8
+
+#define SR_WEL    0x02
+
+static uint8_t* image;
+static bool     selected;
+static bool     powerdown;
+static uint8_t  status;
+static uint8_t  cmd;
+static int      pos;
+static uint32_t addr;
+static int      powerdownAccess;
+
+static void imageInit()
+{
+  const char* fn = getenv("EMW_FLASH");
+  int         fd;
+  off_t       size;
+
+  if (fn == NULL)
+    fn = "emw-flash.img";
+
+  fd = open(fn, O_RDWR | O_CREAT, 0644);
+  if (fd == -1) {
+
+    perror(fn);
+    exit(1);
+  }
+
+  size = lseek(fd, 0, SEEK_END);
+  if (size < FLASH_SIZE) {
+
+    uint8_t erased[PAGE_SIZE];
+
+    // New flash chip is fully erased.
+    memset(erased, 0xFF, sizeof(erased));
+    while (size < FLASH_SIZE)
+      size += write(fd, erased, sizeof(erased));
+  }
+
+  image = mmap(NULL, FLASH_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (image == MAP_FAILED) {
+
+    perror("mmap");
+    exit(1);
+  }
+
+  close(fd);
+}
+
+void spiInit(struct uosSpiBus* bus)
+{
+  if (image == NULL)
+    imageInit();
+}
+
+static void erase(uint32_t start, int len)
+{
+  if (!(status & SR_WEL))
+    return;
+
+  start &= ~(len - 1);
+  memset(image + start, 0xFF, len);
+  status &= ~SR_WEL;
+}
+
+void spiCs(struct uosSpiBus* bus, bool select)
+{
+  P_ASSERT("spiCsCurrentSet", bus->currentDev != NULL);
+
+  if (select) {
+
+    selected = true;
+    pos = 0;
+    addr = 0;
+    return;
+  }
+
+  selected = false;
+  if (powerdown || pos == 0)
+    return;
+
+  // Erase and program complete when chip is deselected.
+  switch (cmd) {
+  case CMD_SE:
+    erase(addr, 4 * 1024);
+    break;
+
+  case CMD_BE32:
+    erase(addr, 32 * 1024);
+    break;
+
+  case CMD_BE:
+    erase(addr, 64 * 1024);
+    break;
+
+  case CMD_CE:
+  case CMD_CE2:
+    erase(0, FLASH_SIZE);
+    break;
+
+  case CMD_PP:
+    status &= ~SR_WEL;
+    break;
+
+  case CMD_WREN:
+    status |= SR_WEL;
+    break;
+
+  case CMD_WRDI:
+    status &= ~SR_WEL;
+    break;
+
+  case CMD_DP:
+    powerdown = true;
+    break;
+  }
+}
+
+uint8_t spiXchg(const struct uosSpiBus* bus, uint8_t wr)
+{
+  static const uint8_t jedec[] = { 0xC2, 0x20, 0x15 };
+  uint8_t rd = 0xFF;
+
+  if (!selected)
+    return rd;
+
+  if (pos == 0)
+    cmd = wr;
+
+  if (powerdown) {
+
+    if (cmd == CMD_RES) {
+
+      powerdown = false;
+      ++pos;
+      return rd;
+    }
+
+    if (pos == 0 && ++powerdownAccess <= 10)
+      printf("spiflash: command 0x%02x while in deep powerdown.\n", cmd);
+
+    ++pos;
+    return rd;
+  }
+
+  if (pos >= 1 && pos <= 3)
+    addr = (addr << 8) | wr;
+
+  switch (cmd) {
+  case CMD_RDSR:
+    if (pos > 0)
+      rd = status;
+    break;
+
+  case CMD_RDID:
+    if (pos >= 1 && pos <= 3)
+      rd = jedec[pos - 1];
+    break;
+
+  case CMD_READ:
+    if (pos > 3)
+      rd = image[(addr + pos - 4) % FLASH_SIZE];
+    break;
+
+  case CMD_FREAD:
+    if (pos > 4)
+      rd = image[(addr + pos - 5) % FLASH_SIZE];
+    break;
+
+  case CMD_PP:
+    if (pos > 3 && (status & SR_WEL)) {
+
+      // Programming wraps at page boundary and can only clear bits.
+      uint32_t a = (addr & ~(PAGE_SIZE - 1)) | ((addr + pos - 4) & (PAGE_SIZE - 1));
+
+      image[a % FLASH_SIZE] &= wr;
+    }
+    break;
+
+  case CMD_RES:
+    if (pos > 3)
+      rd = 0x14;
+    break;
+  }
+
+  ++pos;
+  return rd;
+}
@@ -0,0 +1,149 @@
+/*
+ * Copyright (c) 2019, Ari Suutari <ari@stonepile.fi>.
+ * All rights reserved. 
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 
+ *  1. Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *  3. The name of the author may not be used to endorse or promote
+ *     products derived from this software without specific prior written
+ *     permission. 
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS
+ * OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT,
+ * INDIRECT,  INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Test clock confidence with default configuration:
+ * SNTP must be skipped while expected error is within
+ * bound, also after clock has been restored from RTC.
+ */
+
+#include <picoos.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <sys/time.h>
+
+#include "emw-sensor.h"
+#include "testsim.h"
+
+#define SEC            1000000LL
+#define T_2019_05_01   1556668800LL
+
+/*
+ * SNTP response with true time.
+ */
+static bool sntp()
+{
+  return clockSync(simNow / SEC, simNow % SEC);
+}
+
+static void testFirstSync()
+{
+  simSetTime(T_2019_05_01 * SEC + 300000);
+  simReset();
+  clockRestore();
+  CHECK(clockNeedsSync());
+
+  CHECK(sntp());
+  CHECK(simClockError() == 0);
+  CHECK(clockError() == 0);
+  CHECK(!clockNeedsSync());
+}
+
+static void testSubSecond()
+{
+  // Clock half a second off is set, not kept as residual.
+  simAdvance(600 * SEC);
+  simSetClockError(-500000);
+  CHECK(sntp());
+  CHECK(simClockError() == 0);
+  CHECK(!clockNeedsSync());
+
+  // Small error is left as it is.
+  simAdvance(600 * SEC);
+  simSetClockError(10000);
+  CHECK(!sntp());
+  CHECK(clockError() == 10);
+  CHECK(!clockNeedsSync());
+}
+
+static void testDrift()
+{
+  // Clock 200 ppm fast over an hour.
+  simSetClockError(0);
+  sntp();
+  simAdvance(3600 * SEC);
+  simSetClockError(720000);
+  CHECK(sntp());
+  CHECK(simClockError() == 0);
+
+  simAdvance(3600 * SEC);
+  CHECK(clockError() == 720);
+}
+
+/*
+ * Reset at given fraction of second after clock
+ * has been set at another fraction.
+ */
+static void testRestore(int64_t setFrac, int64_t resetFrac)
+{
+  int64_t error;
+
+  simSetTime((T_2019_05_01 + 86400) * SEC + setFrac);
+  simSetClockError(3 * SEC);
+  CHECK(sntp());
+
+  simAdvance(1800 * SEC - setFrac + resetFrac);
+  simReset();
+  CHECK(!timeOk());
+
+  rtcInit();
+  clockRestore();
+  error = simClockError();
+  if (llabs(error) > 500000)
+    printf("Restore error %lld us, clock set at %lld us, reset at %lld us.\n",
+           (long long)error, (long long)setFrac, (long long)resetFrac);
+
+  CHECK(llabs(error) <= 500000);
+  CHECK(abs(clockError() - (500 + 1800 * 100 / 1000)) <= 1);
+  CHECK(!clockNeedsSync());
+
+  // 100 ppm for 5000 s uses up the rest of 1000 ms bound.
+  simAdvance(3200 * SEC);
+  CHECK(!clockNeedsSync());
+  simAdvance(20 * SEC);
+  CHECK(clockNeedsSync());
+}
+
+int main(int argc, char** argv)
+{
+  static const int64_t fracs[] = { 0, 1000, 250000, 500000, 999000 };
+  int i, j;
+
+  testFirstSync();
+  testSubSecond();
+  testDrift();
+
+  for (i = 0; i < (int)(sizeof(fracs) / sizeof(fracs[0])); i++)
+    for (j = 0; j < (int)(sizeof(fracs) / sizeof(fracs[0])); j++)
+      testRestore(fracs[i], fracs[j]);
+
+  return testResult("clocktest");
+}
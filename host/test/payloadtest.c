@@ -0,0 +1,149 @@
+/*
+ * Copyright (c) 2019, Ari Suutari <ari@stonepile.fi>.
+ * All rights reserved. 
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 
+ *  1. Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *  3. The name of the author may not be used to endorse or promote
+ *     products derived from this software without specific prior written
+ *     permission. 
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS
+ * OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT,
+ * INDIRECT,  INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Encode a measurement payload with payload.c and write
+ * it to stdout, in same structure as buildPayload in
+ * potato.c. test_cbor2json.py compares CBOR output
+ * decoded by cbor2json.py with JSON output.
+ *
+ * Usage: payloadtest json|cbor [delta]
+ */
+
+#include <picoos.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/time.h>
+
+#include "emw-sensor.h"
+
+static const int16_t kitchen[] = { 344, 346, SAMPLE_INVALID, 343, -2, 1040 };
+static const int16_t garage[]  = { -40, SAMPLE_INVALID, -41 };
+
+static void temperatures(Payload* p, const char* name, const int16_t* v, int count, bool delta)
+{
+  int16_t prev = SAMPLE_INVALID;
+  int     i;
+
+  payloadKey(p, name);
+  payloadStartArray(p);
+  for (i = 0; i < count; i++) {
+
+    if (v[i] == SAMPLE_INVALID)
+      payloadNull(p);
+    else if (!delta)
+      payloadDouble(p, sampleToCelsius(v[i]));
+    else {
+
+      payloadInteger(p, prev == SAMPLE_INVALID ? v[i] : v[i] - prev);
+      prev = v[i];
+    }
+  }
+
+  payloadEndArray(p);
+}
+
+static void build(Payload* p, bool delta)
+{
+  payloadStartObject(p);
+  payloadKey(p, "timeStep");
+  payloadInteger(p, 600);
+  if (delta) {
+
+    payloadKey(p, "delta");
+    payloadInteger(p, 16);
+  }
+
+  payloadKey(p, "timeStamp");
+  payloadString(p, "2019-05-01T12:00:00Z");
+
+  payloadKey(p, "locations");
+  payloadStartObject(p);
+
+  payloadKey(p, "kitchen");
+  payloadStartObject(p);
+  temperatures(p, "temperature", kitchen, sizeof(kitchen) / sizeof(kitchen[0]), delta);
+  payloadEndObject(p);
+
+  payloadKey(p, "garage \"north\"");
+  payloadStartObject(p);
+  temperatures(p, "temperature1", garage, sizeof(garage) / sizeof(garage[0]), delta);
+  payloadEndObject(p);
+
+  payloadKey(p, "kitchenNode");
+  payloadStartObject(p);
+  payloadKey(p, "rssi");
+  payloadInteger(p, -61);
+  payloadKey(p, "uptime");
+  payloadInteger(p, 100000);
+  payloadKey(p, "battery");
+  payloadDouble(p, 2.9);
+  payloadEndObject(p);
+
+  payloadEndObject(p);
+  payloadEndObject(p);
+}
+
+int main(int argc, char** argv)
+{
+  Payload  p;
+  uint8_t* buf;
+  int      format;
+  bool     delta;
+  int      size;
+
+  if (argc < 2) {
+
+    fprintf(stderr, "usage: payloadtest json|cbor [delta]\n");
+    return 2;
+  }
+
+  format = strcmp(argv[1], "cbor") ? PAYLOAD_JSON : PAYLOAD_CBOR;
+  delta = argc > 2 && !strcmp(argv[2], "delta");
+
+  payloadInit(&p, NULL, 0, format);
+  build(&p, delta);
+  size = p.len;
+
+  buf = malloc(size);
+  payloadInit(&p, buf, size, format);
+  build(&p, delta);
+  if (p.overflow || p.len != size) {
+
+    fprintf(stderr, "payload size changed from %d to %d bytes\n", size, p.len);
+    return 1;
+  }
+
+  fwrite(buf, 1, size, stdout);
+  free(buf);
+  return 0;
+}
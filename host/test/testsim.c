@@ -0,0 +1,235 @@
+/*
+ * Copyright (c) 2019, Ari Suutari <ari@stonepile.fi>.
+ * All rights reserved. 
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 
+ *  1. Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *  3. The name of the author may not be used to endorse or promote
+ *     products derived from this software without specific prior written
+ *     permission. 
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS
+ * OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT,
+ * INDIRECT,  INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <picoos.h>
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+#include <time.h>
+#include <sys/time.h>
+#include <eshell.h>
+
+#include "emw-sensor.h"
+#include "testsim.h"
+
+int     testFailures;
+int64_t simNow;
+
+volatile JIF_t jiffies;
+
+static int64_t clockOffset;   // system clock - true time, us
+
+static struct tm rtcCalendar = { .tm_mday = 1, .tm_year = 100 };
+static int64_t   rtcSetAt;
+static uint32_t  rtcBackup[20];
+
+void simSetTime(int64_t us)
+{
+  simNow = us;
+}
+
+void simAdvance(int64_t us)
+{
+  simNow += us;
+}
+
+void simSetClockError(int64_t us)
+{
+  clockOffset = us;
+}
+
+int64_t simClockError()
+{
+  return clockOffset;
+}
+
+/*
+ * System reset: clock starts from zero, RTC and
+ * backup registers are kept.
+ */
+void simReset()
+{
+  clockOffset = -simNow;
+  jiffies = 0;
+}
+
+int testResult(const char* name)
+{
+  if (testFailures > 0) {
+
+    printf("%s: %d checks failed.\n", name, testFailures);
+    return 1;
+  }
+
+  printf("%s: ok.\n", name);
+  return 0;
+}
+
+/*
+ * System clock calls are wrapped by linker.
+ */
+int __wrap_gettimeofday(struct timeval* tv, void* tz)
+{
+  int64_t t = simNow + clockOffset;
+
+  tv->tv_sec = t / 1000000;
+  tv->tv_usec = t % 1000000;
+  return 0;
+}
+
+int __wrap_settimeofday(const struct timeval* tv, const void* tz)
+{
+  clockOffset = (int64_t)tv->tv_sec * 1000000 + tv->tv_usec - simNow;
+  return 0;
+}
+
+time_t __wrap_time(time_t* t)
+{
+  time_t now = (simNow + clockOffset) / 1000000;
+
+  if (t != NULL)
+    *t = now;
+
+  return now;
+}
+
+bool timeOk()
+{
+  return __wrap_time(NULL) > T_2017_01_01;
+}
+
+/*
+ * Calendar counts whole seconds since it was set.
+ */
+static void rtcNow(struct tm* tm)
+{
+  time_t t = timegm(&rtcCalendar) + (simNow - rtcSetAt) / 1000000;
+
+  gmtime_r(&t, tm);
+}
+
+ErrorStatus RTC_SetTime(uint32_t format, RTC_TimeTypeDef* rtcTime)
+{
+  rtcNow(&rtcCalendar);
+  rtcCalendar.tm_hour = rtcTime->RTC_Hours;
+  rtcCalendar.tm_min  = rtcTime->RTC_Minutes;
+  rtcCalendar.tm_sec  = rtcTime->RTC_Seconds;
+  rtcSetAt = simNow;
+  return SUCCESS;
+}
+
+ErrorStatus RTC_SetDate(uint32_t format, RTC_DateTypeDef* rtcDate)
+{
+  rtcNow(&rtcCalendar);
+  rtcCalendar.tm_mday = rtcDate->RTC_Date;
+  rtcCalendar.tm_mon  = rtcDate->RTC_Month - 1;
+  rtcCalendar.tm_year = rtcDate->RTC_Year + 100;
+  rtcSetAt = simNow - (simNow - rtcSetAt) % 1000000;
+  return SUCCESS;
+}
+
+void RTC_GetTime(uint32_t format, RTC_TimeTypeDef* rtcTime)
+{
+  struct tm tm;
+
+  rtcNow(&tm);
+  rtcTime->RTC_Hours   = tm.tm_hour;
+  rtcTime->RTC_Minutes = tm.tm_min;
+  rtcTime->RTC_Seconds = tm.tm_sec;
+}
+
+void RTC_GetDate(uint32_t format, RTC_DateTypeDef* rtcDate)
+{
+  struct tm tm;
+
+  rtcNow(&tm);
+  rtcDate->RTC_Date  = tm.tm_mday;
+  rtcDate->RTC_Month = tm.tm_mon + 1;
+  rtcDate->RTC_Year  = tm.tm_year - 100;
+}
+
+ErrorStatus RTC_WaitForSynchro()
+{
+  return SUCCESS;
+}
+
+void RTC_WriteBackupRegister(uint32_t reg, uint32_t data)
+{
+  rtcBackup[reg] = data;
+}
+
+uint32_t RTC_ReadBackupRegister(uint32_t reg)
+{
+  return rtcBackup[reg];
+}
+
+/*
+ * Configuration is empty, so defaults are used.
+ */
+const char* uosConfigGet(const char* key)
+{
+  return "";
+}
+
+int uosConfigSet(const char* key, const char* value)
+{
+  return 0;
+}
+
+void logPrintf(const char* fmt, ...)
+{
+  va_list ap;
+
+  va_start(ap, fmt);
+  vprintf(fmt, ap);
+  va_end(ap);
+}
+
+char* eshNamedArg(EshContext* ctx, const char* name, bool hasValue)
+{
+  return NULL;
+}
+
+void eshCheckNamedArgsUsed(EshContext* ctx)
+{
+}
+
+void eshCheckArgsUsed(EshContext* ctx)
+{
+}
+
+int eshArgError(EshContext* ctx)
+{
+  return EshOK;
+}
+
+void eshPrintf(EshContext* ctx, const char* fmt, ...)
+{
+}
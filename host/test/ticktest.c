@@ -0,0 +1,141 @@
+/*
+ * Copyright (c) 2019, Ari Suutari <ari@stonepile.fi>.
+ * All rights reserved. 
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 
+ *  1. Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *  3. The name of the author may not be used to endorse or promote
+ *     products derived from this software without specific prior written
+ *     permission. 
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS
+ * OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT,
+ * INDIRECT,  INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Test rtcTickCheck over simulated sleeps. Only the check
+ * is tested here: tickless compensation of jiffies is done
+ * by pico]OS port, which is not part of this build, so
+ * test advances jiffies itself. Check must stay quiet while
+ * jiffies follow true time, also over jiffies wraparound,
+ * and notice when they lose time or step backwards.
+ */
+
+#include <picoos.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <sys/time.h>
+
+#include "emw-sensor.h"
+#include "testsim.h"
+
+#define SEC            1000000LL
+#define T_2019_05_01   1556668800LL
+#define CYCLES         2000
+
+/*
+ * Sleep or run for given number of ms, jiffies
+ * advance by given ppm slower than true time.
+ */
+static void tickSleep(int64_t ms, int slowPpm)
+{
+  simAdvance(ms * 1000);
+  jiffies += MS(ms - ms * slowPpm / 1000000);
+}
+
+static void testSleeps()
+{
+  struct timeval tv;
+  uint32_t seed = 1;
+  int      i;
+
+  simSetTime(T_2019_05_01 * SEC + 123456);
+
+  // Start close to wraparound.
+  jiffies = (JIF_t)-MS(100000);
+
+  tv.tv_sec  = simNow / SEC;
+  tv.tv_usec = simNow % SEC;
+  rtcSetTime(&tv);
+  rtcTickCheck();
+
+  for (i = 0; i < CYCLES; i++) {
+
+    // Measurement cycle is awake for a while, sleeps
+    // in between are of varying length.
+    seed = seed * 1103515245 + 12345;
+    tickSleep(20 + (seed >> 16) % 2000, 0);
+
+    seed = seed * 1103515245 + 12345;
+    tickSleep(50 + (seed >> 8) % 600000, 0);
+
+    rtcTickCheck();
+    CHECK(abs(rtcTickDrift()) <= 1000);
+  }
+
+  CHECK(rtcTickBacksteps() == 0);
+}
+
+static void testSlowJiffies()
+{
+  int drift = rtcTickDrift();
+  int i;
+
+  // Jiffies 100 ppm slow, 3 s in about 8 hours.
+  for (i = 0; i < 50; i++) {
+
+    tickSleep(600000, 100);
+    rtcTickCheck();
+  }
+
+  CHECK(rtcTickDrift() - drift <= -2000);
+  CHECK(rtcTickDrift() - drift >= -4000);
+}
+
+static void testLostSleep()
+{
+  int drift = rtcTickDrift();
+
+  // Jiffies are not advanced after a sleep.
+  simAdvance(600 * SEC);
+  tickSleep(10, 0);
+  rtcTickCheck();
+  CHECK(rtcTickDrift() - drift <= -599000);
+}
+
+static void testBackstep()
+{
+  int backsteps = rtcTickBacksteps();
+
+  tickSleep(10, 0);
+  jiffies -= MS(5000);
+  rtcTickCheck();
+  CHECK(rtcTickBacksteps() == backsteps + 1);
+}
+
+int main(int argc, char** argv)
+{
+  testSleeps();
+  testSlowJiffies();
+  testLostSleep();
+  testBackstep();
+
+  return testResult("ticktest");
+}
@@ -0,0 +1,185 @@
+/*
+ * Copyright (c) 2019, Ari Suutari <ari@stonepile.fi>.
+ * All rights reserved. 
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 
+ *  1. Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *  3. The name of the author may not be used to endorse or promote
+ *     products derived from this software without specific prior written
+ *     permission. 
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS
+ * OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT,
+ * INDIRECT,  INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Simulated wifi radio for host build. Joining always
+ * succeeds, packets go through tap interface (tap0 by
+ * default, see lwIP unix port). Join takes roughly the
+ * time a real chip spends in scan or directed join.
+ */
+
+#include <picoos.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdbool.h>
+
+#include "lwip/netif.h"
+#include "netif/tapif.h"
+#include <wiced-driver.h>
+
+#define FIRMWARE_LOAD_MS 450
+#define RESUME_MS        15
+#define SCAN_JOIN_MS     2000
+#define DIRECTED_JOIN_MS 300
+#define AP_CHANNEL       6
+
+static const wiced_mac_t apBssid = { { 0x02, 0x00, 0x00, 0x00, 0x00, 0xfe } };
+
+static bool radioOn;
+static bool resident;
+static bool joined;
+
+wwd_result_t wwd_buffer_init(void* arg)
+{
+  return WWD_SUCCESS;
+}
+
+wwd_result_t wwd_management_wifi_on(uint32_t country)
+{
+  if (!resident)
+    posTaskSleep(MS(FIRMWARE_LOAD_MS));
+
+  radioOn = true;
+  resident = true;
+  return WWD_SUCCESS;
+}
+
+wwd_result_t wwd_management_wifi_off()
+{
+  radioOn = false;
+  resident = false;
+  joined = false;
+  return WWD_SUCCESS;
+}
+
+wwd_result_t wwd_wifi_set_up()
+{
+  if (!resident)
+    return WWD_NOT_UP;
+
+  posTaskSleep(MS(RESUME_MS));
+  radioOn = true;
+  return WWD_SUCCESS;
+}
+
+wwd_result_t wwd_wifi_set_down()
+{
+  radioOn = false;
+  joined = false;
+  return WWD_SUCCESS;
+}
+
+wwd_result_t wwd_wifi_join(const wiced_ssid_t* ssid, wiced_security_t security,
+                           const uint8_t* key, uint8_t keyLength,
+                           host_semaphore_type_t* semaphore, wwd_interface_t interface)
+{
+  if (!radioOn)
+    return WWD_NOT_UP;
+
+  posTaskSleep(MS(SCAN_JOIN_MS));
+  joined = true;
+  return WWD_SUCCESS;
+}
+
+wwd_result_t wwd_wifi_join_specific(const wiced_scan_result_t* ap, const uint8_t* key, uint8_t keyLength,
+                                    host_semaphore_type_t* semaphore, wwd_interface_t interface)
+{
+  if (!radioOn)
+    return WWD_NOT_UP;
+
+  posTaskSleep(MS(DIRECTED_JOIN_MS));
+  if (memcmp(&ap->BSSID, &apBssid, sizeof(apBssid)) || ap->channel != AP_CHANNEL)
+    return WWD_TIMEOUT;
+
+  joined = true;
+  return WWD_SUCCESS;
+}
+
+wwd_result_t wwd_wifi_get_bssid(wiced_mac_t* bssid)
+{
+  *bssid = apBssid;
+  return joined ? WWD_SUCCESS : WWD_NOT_UP;
+}
+
+wwd_result_t wwd_wifi_get_channel(wwd_interface_t interface, uint32_t* channel)
+{
+  *channel = AP_CHANNEL;
+  return WWD_SUCCESS;
+}
+
+/*
+ * Real chip derives PMK with PBKDF2, simulated one just
+ * returns a recognizable hex string.
+ */
+wwd_result_t wwd_wifi_get_pmk(const char* psk, uint8_t pskLength, char* pmk)
+{
+  int i;
+
+  for (i = 0; i < WSEC_MAX_PSK_LEN; i++)
+    pmk[i] = "0123456789abcdef"[(uint8_t)psk[i % pskLength] % 16];
+
+  return WWD_SUCCESS;
+}
+
+wwd_result_t wwd_wifi_leave(wwd_interface_t interface)
+{
+  joined = false;
+  return WWD_SUCCESS;
+}
+
+wwd_result_t wwd_wifi_get_mac_address(wiced_mac_t* mac, wwd_interface_t interface)
+{
+  static const uint8_t hostMac[6] = { 0x02, 0x00, 0x00, 0x00, 0x00, 0x01 };
+
+  memcpy(mac->octet, hostMac, sizeof(hostMac));
+  return WWD_SUCCESS;
+}
+
+wwd_result_t wwd_wifi_is_ready_to_transceive(wwd_interface_t interface)
+{
+  return joined ? WWD_SUCCESS : WWD_NOT_UP;
+}
+
+wwd_result_t wwd_wifi_get_rssi(int32_t* rssi)
+{
+  *rssi = joined ? -55 : 0;
+  return WWD_SUCCESS;
+}
+
+wwd_result_t wwd_wifi_get_noise(int32_t* noise)
+{
+  *noise = joined ? -92 : 0;
+  return WWD_SUCCESS;
+}
+
+err_t ethernetif_init(struct netif* netif)
+{
+  return tapif_init(netif);
+}
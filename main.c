@@ -52,6 +52,7 @@
 #include "lwip/init.h"
 
 #include "lwip/priv/tcp_priv.h"
+#include "netif/ethernet.h"
 
 #include "wwd_management.h"
 #include "wwd_wifi.h"
@@ -98,6 +99,59 @@ int getUptime()
   return uptime;
 }
 
+/*
+ * Connections are drained before wifi is turned off.
+ * Incoming packets are processed by drainInput, which
+ * checks after each one if last connection has been
+ * closed (time_wait connections are ignored).
+ */
+#define DRAIN_TIMEOUT_MS 5000
+
+static POSSEMA_t drainSema;
+static bool      draining = false;
+static int       drainAborted;
+
+static void drainCheck()
+{
+  if (draining && tcp_active_pcbs == NULL) {
+
+    draining = false;
+    nosSemaSignal(drainSema);
+  }
+}
+
+static err_t drainEthernetInput(struct pbuf* p, struct netif* netif)
+{
+  err_t err = ethernet_input(p, netif);
+
+  drainCheck();
+  return err;
+}
+
+static err_t drainInput(struct pbuf* p, struct netif* netif)
+{
+  return tcpip_inpkt(p, netif, drainEthernetInput);
+}
+
+static void drainStart(void* arg)
+{
+  draining = true;
+  drainCheck();
+}
+
+static void drainAbort(void* arg)
+{
+  draining = false;
+  drainAborted = 0;
+  while (tcp_active_pcbs != NULL) {
+
+    tcp_abort(tcp_active_pcbs);
+    ++drainAborted;
+  }
+
+  nosSemaSignal(drainSema);
+}
+
 /*
  * This is called by lwip when basic initialization has been completed.
  */
@@ -113,10 +167,12 @@ static void tcpipInitDone(void *arg)
  * Bring WIFI up.
  */
   wwd_buffer_init(NULL);
+  energyOn(ENERGY_RADIO);
   if ((result = wwd_management_wifi_on(WICED_COUNTRY_FINLAND)) != WWD_SUCCESS) {
 
     printf("WWD init error %d, retrying after some time.\n", result);
     wwd_management_wifi_off();
+    energyOff(ENERGY_RADIO);
     posPowerEnableSleep();
     posTaskSleep(MS(30 * 60 * 1000));
     NVIC_SystemReset();
@@ -143,7 +199,7 @@ static void tcpipInitDone(void *arg)
             &gw,
             (void*)WWD_STA_INTERFACE,
             ethernetif_init,
-            tcpip_input);
+            drainInput);
 
   netif_set_default(&defaultIf);
 /*
@@ -154,12 +210,16 @@ static void tcpipInitDone(void *arg)
 
 static void tcpipDrain()
 {
-  // Wait until there are no active connections.
-  // (ignore those in time_wait state).
-  while (tcp_active_pcbs) {
+  while (nosSemaWait(drainSema, 0) == 0);
 
-    posTaskSleep(MS(250));
-  }
+  tcpip_callback_with_block(drainStart, NULL, true);
+  if (nosSemaWait(drainSema, MS(DRAIN_TIMEOUT_MS)) == 0)
+    return;
+
+  tcpip_callback_with_block(drainAbort, NULL, true);
+  nosSemaGet(drainSema);
+  if (drainAborted > 0)
+    logPrintf("Drain timeout, %d connections aborted.\n", drainAborted);
 }
 
 static void tcpipSuspend(void* arg)
@@ -202,22 +262,31 @@ int getLastCycleTime()
 
 static bool sendValues()
 {
-  bool ok = true;
+  bool mqttOk = true;
+  bool veraOk = true;
 
 #if USE_MQTT
-  if (!potatoSend())
-    ok = false;
+  mqttOk = potatoSend();
 #endif
 
 #if USE_VERA
-  if (!veraSend())
-    ok = false;
+  JIF_t start = jiffies;
+
+  energyOn(ENERGY_TX);
+  veraOk = veraSend();
+  energyOff(ENERGY_TX);
+
+  timingPhase(PHASE_VERA, start);
 #endif
 
-  if (ok)
+  // Spool is delivered only over MQTT. Vera gets
+  // only latest values, so it would not use spooled ones.
+  if (mqttOk)
     sensorClearHistory();
+  else
+    spoolHistory();
 
-  return ok;
+  return mqttOk && veraOk;
 }
 
 static void mainTask(void* arg)
@@ -229,10 +298,13 @@ static void mainTask(void* arg)
   watchdogDiag();
   printf("lwIP %s WICED SDK %s\n", LWIP_VERSION_STRING, WICED_SDK_VERSION);
   devTreeInit();
+  energyInit();
+  rtcInit();
 
   flashPowerup(); // ensure that flash chip is not in deep powerdown
   fsInit();
   initConfig();
+  spoolInit();
   netInit();
 
 /* 
@@ -301,8 +373,11 @@ static void mainTask(void* arg)
       staDown();
   }
   else
-    if (!online)
+    if (!online) {
+
       wwd_management_wifi_off();
+      energyOff(ENERGY_RADIO);
+    }
 
 #if USE_MQTT
   potatoInit();
@@ -330,11 +405,17 @@ static void mainTask(void* arg)
   bool sendOk;
 
   sendSema = nosSemaCreate(0, 0, "send*");
+  drainSema = nosSemaCreate(0, 0, "drain");
   while (1) {
 
     if (retries > 10) {
 
       printf("Too many send failures. Resetting system.\n");
+
+      // Reset clears history in RAM, keep it in flash.
+      sensorLock();
+      spoolHistory();
+      sensorUnlock();
       posTaskSleep(MS(2000));
       NVIC_SystemReset();
     }
@@ -356,23 +437,43 @@ static void mainTask(void* arg)
     }
 
     start = jiffies;
+    timingStart();
     ++uptime;
     ++retries;
 
+    // Flash is powered up now, store 1-wire inventory if needed.
+    sensorSaveInventory();
+
     if (online) {
 
       if (wwd_wifi_is_ready_to_transceive(WWD_STA_INTERFACE) != WWD_SUCCESS) {
    
         logPrintf("Wifi has failed, reconnecting.\n");
+#if USE_MQTT
+        potatoClose();
+#endif
         staDown();
-        if (!staUp())
+        if (!staUp()) {
+
+          sensorLock();
+          spoolHistory();
+          sensorUnlock();
+          timingEnd();
           continue;
+        }
       }
     }
     else {
 
-      if (!staUp())
+      if (!staUp()) {
+
+        // Keep measurements safe in flash until next cycle.
+        sensorLock();
+        spoolHistory();
+        sensorUnlock();
+        timingEnd();
         continue;
+      }
     }
 
     sensorLock();
@@ -405,7 +506,10 @@ static void mainTask(void* arg)
 
     if (!online) {
 
+      JIF_t drainAt = jiffies;
+
       tcpipDrain();
+      timingPhase(PHASE_DRAIN, drainAt);
       staDown();
     }
 
@@ -414,6 +518,9 @@ static void mainTask(void* arg)
       retries = 0;
 
     delta = jiffies - start;
+    timingEnd();
+    energyCycle();
+    rtcTickCheck();
 
     logPrintf("Cycle time %d ms.\n", delta);
     uosResourceDiag();
@@ -0,0 +1,301 @@
+/*
+ * Copyright (c) 2019, Ari Suutari <ari@stonepile.fi>.
+ * All rights reserved. 
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 
+ *  1. Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *  3. The name of the author may not be used to endorse or promote
+ *     products derived from this software without specific prior written
+ *     permission. 
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS
+ * OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT,
+ * INDIRECT,  INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Streaming payload encoder. Payload is generated twice:
+ * first pass only computes the size, second one writes
+ * into a buffer allocated for exact size. This way
+ * payload size is not limited by a static buffer.
+ *
+ * Payload is either JSON or CBOR (RFC 7049) with same
+ * structure. CBOR maps and arrays use indefinite length
+ * so they can be streamed, numbers are sent as
+ * half-floats when that is exact.
+ */
+
+#include <picoos.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <string.h>
+#include <math.h>
+#include "emw-sensor.h"
+
+void payloadInit(Payload* p, uint8_t* buf, int size, int format)
+{
+  p->format   = format;
+  p->buf      = buf;
+  p->size     = size;
+  p->len      = 0;
+  p->overflow = false;
+  p->depth    = 0;
+  p->first    = 1;
+}
+
+static void put(Payload* p, const void* data, int len)
+{
+  if (p->buf != NULL) {
+
+    if (p->len + len > p->size)
+      p->overflow = true;
+    else
+      memcpy(p->buf + p->len, data, len);
+  }
+
+  p->len += len;
+}
+
+static void putc1(Payload* p, uint8_t c)
+{
+  put(p, &c, 1);
+}
+
+/*
+ * Emit comma before value unless it is first
+ * in container or follows a key.
+ */
+static void separator(Payload* p)
+{
+  uint32_t bit = 1 << p->depth;
+
+  if (p->first & bit)
+    p->first &= ~bit;
+  else
+    putc1(p, ',');
+}
+
+/*
+ * CBOR data item header: major type and argument.
+ */
+static void cborHead(Payload* p, int major, uint32_t arg)
+{
+  uint8_t hdr[5];
+
+  major <<= 5;
+  if (arg < 24) {
+
+    hdr[0] = major | arg;
+    put(p, hdr, 1);
+  }
+  else if (arg <= 0xFF) {
+
+    hdr[0] = major | 24;
+    hdr[1] = arg;
+    put(p, hdr, 2);
+  }
+  else if (arg <= 0xFFFF) {
+
+    hdr[0] = major | 25;
+    hdr[1] = arg >> 8;
+    hdr[2] = arg;
+    put(p, hdr, 3);
+  }
+  else {
+
+    hdr[0] = major | 26;
+    hdr[1] = arg >> 24;
+    hdr[2] = arg >> 16;
+    hdr[3] = arg >> 8;
+    hdr[4] = arg;
+    put(p, hdr, 5);
+  }
+}
+
+/*
+ * Convert to IEEE half-float, if it can be
+ * done without losing precision.
+ */
+static bool toHalf(double value, uint16_t* half)
+{
+  double m;
+  double frac;
+  int    e;
+
+  if (value == 0) {
+
+    *half = signbit(value) ? 0x8000 : 0;
+    return true;
+  }
+
+  m = frexp(fabs(value), &e);
+  e += 14;
+  if (e < 1 || e > 30)
+    return false;
+
+  frac = (2 * m - 1) * 1024;
+  if (frac != floor(frac))
+    return false;
+
+  *half = (value < 0 ? 0x8000 : 0) | (e << 10) | (int)frac;
+  return true;
+}
+
+static void start(Payload* p, char c)
+{
+  if (p->format == PAYLOAD_CBOR) {
+
+    putc1(p, c == '{' ? 0xBF : 0x9F);
+    return;
+  }
+
+  separator(p);
+  putc1(p, c);
+  p->depth++;
+  p->first |= 1 << p->depth;
+}
+
+void payloadStartObject(Payload* p)
+{
+  start(p, '{');
+}
+
+void payloadStartArray(Payload* p)
+{
+  start(p, '[');
+}
+
+static void end(Payload* p, char c)
+{
+  if (p->format == PAYLOAD_CBOR) {
+
+    putc1(p, 0xFF);
+    return;
+  }
+
+  p->first &= ~(1 << p->depth);
+  p->depth--;
+  putc1(p, c);
+}
+
+void payloadEndObject(Payload* p)
+{
+  end(p, '}');
+}
+
+void payloadEndArray(Payload* p)
+{
+  end(p, ']');
+}
+
+void payloadString(Payload* p, const char* str)
+{
+  if (p->format == PAYLOAD_CBOR) {
+
+    cborHead(p, 3, strlen(str));
+    put(p, str, strlen(str));
+    return;
+  }
+
+  separator(p);
+  putc1(p, '"');
+  for (; *str; str++) {
+
+    if (*str == '"' || *str == '\\')
+      putc1(p, '\\');
+
+    putc1(p, *str);
+  }
+
+  putc1(p, '"');
+}
+
+void payloadKey(Payload* p, const char* key)
+{
+  payloadString(p, key);
+  if (p->format == PAYLOAD_CBOR)
+    return;
+
+  putc1(p, ':');
+
+  // Value follows key without comma.
+  p->first |= 1 << p->depth;
+}
+
+void payloadInteger(Payload* p, int value)
+{
+  char num[12];
+
+  if (p->format == PAYLOAD_CBOR) {
+
+    if (value >= 0)
+      cborHead(p, 0, value);
+    else
+      cborHead(p, 1, -1 - value);
+
+    return;
+  }
+
+  separator(p);
+  put(p, num, sprintf(num, "%d", value));
+}
+
+void payloadDouble(Payload* p, double value)
+{
+  char num[24];
+
+  if (p->format == PAYLOAD_CBOR) {
+
+    uint16_t half;
+    uint32_t bits;
+    float    f = value;
+
+    if (toHalf(value, &half)) {
+
+      putc1(p, 0xF9);
+      putc1(p, half >> 8);
+      putc1(p, half);
+    }
+    else {
+
+      memcpy(&bits, &f, sizeof(bits));
+      putc1(p, 0xFA);
+      putc1(p, bits >> 24);
+      putc1(p, bits >> 16);
+      putc1(p, bits >> 8);
+      putc1(p, bits);
+    }
+
+    return;
+  }
+
+  separator(p);
+  put(p, num, sprintf(num, "%g", value));
+}
+
+void payloadNull(Payload* p)
+{
+  if (p->format == PAYLOAD_CBOR) {
+
+    putc1(p, 0xF6);
+    return;
+  }
+
+  separator(p);
+  put(p, "null", 4);
+}
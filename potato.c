@@ -38,10 +38,10 @@
 #include <math.h>
 #include <eshell.h>
 
+#include "lwip/api.h"
 #include "wwd_wifi.h"
 
 #include "potato-bus.h"
-#include "potato-json.h"
 #include "emw-sensor.h"
 #include "picoos-mbedtls.h"
 
@@ -51,6 +51,52 @@ extern wiced_mac_t   myMac;
 
 static PbClient client;
 
+/*
+ * Keepalive for persistent connection, longer than
+ * measurement cycle with room for random send delay.
+ */
+#define MQTT_KEEPALIVE_SECS (MEAS_CYCLE_SECS * 3 / 2)
+
+/*
+ * Default time budget for sending spooled windows
+ * during one cycle, can be changed with mqtt --budget.
+ */
+#define DEFAULT_SEND_BUDGET_SECS 60
+
+static int sendBudget()
+{
+  const char* value = uosConfigGet("mqtt.budget");
+
+  if (value == NULL || value[0] == '\0')
+    return DEFAULT_SEND_BUDGET_SECS;
+
+  return atoi(value);
+}
+
+static int payloadFormat()
+{
+  const char* value = uosConfigGet("mqtt.format");
+
+  if (value != NULL && !strcmp(value, "cbor"))
+    return PAYLOAD_CBOR;
+
+  return PAYLOAD_JSON;
+}
+
+static bool deltaEncoding()
+{
+  const char* value = uosConfigGet("mqtt.delta");
+
+  return value != NULL && value[0] != '\0';
+}
+
+static bool sendMetrics()
+{
+  const char* value = uosConfigGet("mqtt.metrics");
+
+  return value != NULL && value[0] != '\0';
+}
+
 /*
  * Configure mqtt client.
  */
@@ -59,6 +105,10 @@ static int mqtt(EshContext* ctx)
   char* server   = eshNamedArg(ctx, "server", false);
   char* node     = eshNamedArg(ctx, "node", false);
   char* topic    = eshNamedArg(ctx, "topic", false);
+  char* budget   = eshNamedArg(ctx, "budget", false);
+  char* format   = eshNamedArg(ctx, "format", false);
+  char* delta    = eshNamedArg(ctx, "delta", false);
+  char* metrics  = eshNamedArg(ctx, "metrics", false);
 
   eshCheckNamedArgsUsed(ctx);
   eshCheckArgsUsed(ctx);
@@ -74,7 +124,28 @@ static int mqtt(EshContext* ctx)
   if (topic != NULL)
     uosConfigSet("mqtt.topic", topic);
 
-  if (topic == NULL && node == NULL && server == NULL) {
+  if (budget != NULL)
+    uosConfigSet("mqtt.budget", budget);
+
+  if (format != NULL) {
+
+    if (strcmp(format, "json") && strcmp(format, "cbor")) {
+
+      eshPrintf(ctx, "Format must be json or cbor.\n");
+      return -1;
+    }
+
+    uosConfigSet("mqtt.format", format);
+  }
+
+  if (delta != NULL)
+    uosConfigSet("mqtt.delta", strcmp(delta, "no") ? "yes" : "");
+
+  if (metrics != NULL)
+    uosConfigSet("mqtt.metrics", strcmp(metrics, "no") ? "yes" : "");
+
+  if (topic == NULL && node == NULL && server == NULL && budget == NULL &&
+      format == NULL && delta == NULL && metrics == NULL) {
 
     const char* parm;
 
@@ -86,6 +157,11 @@ static int mqtt(EshContext* ctx)
 
     parm = uosConfigGet("mqtt.node");
     eshPrintf(ctx, "Node: %s\n", parm ? parm : "<not set>");
+
+    eshPrintf(ctx, "Send budget: %d s\n", sendBudget());
+    eshPrintf(ctx, "Format: %s%s\n", payloadFormat() == PAYLOAD_CBOR ? "cbor" : "json",
+                                       deltaEncoding() ? ", delta encoded" : "");
+    eshPrintf(ctx, "Cycle metrics: %s\n", sendMetrics() ? "yes" : "no");
   }
   return 0;
 }
@@ -93,7 +169,7 @@ static int mqtt(EshContext* ctx)
 const EshCommand mqttCommand = {
   .flags = 0,
   .name = "mqtt",
-  .help = "--server mqtt(s)://servername --topic=topic --node=nodeLocation --vera=id configure mqtt client",
+  .help = "--server mqtt(s)://servername --topic=topic --node=nodeLocation --vera=id --budget=secs --format=json|cbor --delta[=no] --metrics[=no] configure mqtt client",
   .handler = mqtt
 }; 
 
@@ -142,16 +218,6 @@ static mbedtls_pk_context  privKey;
 
 #endif
 
-void potatoInit()
-{
-  sprintf(clientId, "EMW%02x%02x%02x%02x%02x%02x", myMac.octet[0],
-                    myMac.octet[1], myMac.octet[2], myMac.octet[3],
-                    myMac.octet[4], myMac.octet[5]);
-
-  connectArgs.clientId = clientId;
-  connectArgs.keepAlive= 60;
-}
-
 #if POTATO_TLS
 
 static bool tlsInitialized = false;
@@ -247,155 +313,280 @@ static void tlsInit()
 
 #endif
 
-static char jsonBuf[1024];
-static JsonContext jsonCtx;
-
-static bool buildJson(const char* nodeLocation)
+/*
+ * Generate payload for one measurement window.
+ * Called twice per window, first for sizing, so
+ * everything here must give same result on both passes.
+ */
+static void buildPayload(Payload* p, const Window* w, const char* nodeLocation,
+                         bool delta, bool metrics, int32_t rssi, int32_t noise)
 {
-  JsonNode* root;
   char      timeStamp[40];
-  char name[40];
+  char      name[40];
   struct tm* t;
-  int32_t rssi;
-  int32_t noise;
+  Sensor*   sensor;
+  int       ns;
+  int       i;
+  int16_t   v;
+  int16_t   prev;
+
+  payloadStartObject(p);
+  payloadKey(p, "timeStep");
+  payloadInteger(p, w->timeStep);
+
+  if (delta) {
+
+    // Temperatures are integers in 1/delta C, first valid
+    // sample absolute, others difference to previous valid one.
+    payloadKey(p, "delta");
+    payloadInteger(p, 16);
+  }
 
-  wwd_wifi_get_rssi(&rssi);
-  wwd_wifi_get_noise(&noise);
+  t = gmtime(&w->time);
+
+  if (t->tm_year > 100) {
 
-  root = jsonGenerate(&jsonCtx, jsonBuf, sizeof(jsonBuf));
+    strftime(timeStamp, sizeof(timeStamp), "%FT%TZ", t);
+    payloadKey(p, "timeStamp");
+    payloadString(p, timeStamp);
+  }
 
-  JsonNode* top;
+  payloadKey(p, "locations");
+  payloadStartObject(p);
 
-  top = jsonStartObject(root);
-  jsonWriteKey(top, "timeStep");
-  jsonWriteInteger(top, MEAS_CYCLE_SECS);
+  sensor = w->sensors + 1;
+  for (ns = 1; ns < w->count; ns++, sensor++) {
 
-  t = gmtime(&sensorTime);
+    if (sensor->location == NULL || sensor->location[0] == '\0')
+      continue;
 
-  if (t->tm_year > 100) {
+    payloadKey(p, sensor->location);
+    payloadStartObject(p);
 
-    strftime(timeStamp, sizeof(timeStamp), "%FT%TZ", t);
-    jsonWriteKey(top, "timeStamp");
-    jsonWriteString(top, timeStamp);
-  }
+    strcpy(name, "temperature");
+    if (ns > 1)
+      sprintf(name + strlen(name), "%d", ns - 1);
 
-  jsonWriteKey(top, "locations");
+    payloadKey(p, name);
+    payloadStartArray(p);
 
-  {
-    JsonNode* locations;
-    Sensor* sensor;
-    int ns;
+    prev = SAMPLE_INVALID;
+    for (i = 0; i < sensor->historyCount; i++) {
 
-    locations = jsonStartObject(top);
-    sensor = sensorList + 1;
-    for (ns = 1; ns < sensorCount; ns++, sensor++) {
+      v = sensorHistory(sensor, i);
+      if (v == SAMPLE_INVALID)
+        payloadNull(p);
+      else if (!delta)
+        payloadDouble(p, sampleToCelsius(v));
+      else {
 
-      if (sensor->location == NULL || sensor->location[0] == '\0')
-        continue;
+        payloadInteger(p, prev == SAMPLE_INVALID ? v : v - prev);
+        prev = v;
+      }
+    }
 
-      jsonWriteKey(locations, sensor->location);
+    payloadEndArray(p);
+    payloadEndObject(p);
+  }
 
-      {
-        JsonNode* s;
+  if (nodeLocation != NULL) {
 
-        s = jsonStartObject(locations);
+    payloadKey(p, nodeLocation);
+    payloadStartObject(p);
 
-        strcpy(name, "temperature");
-        if (ns > 1)
-          sprintf(name + strlen(name), "%d", ns - 1);
+    // Link and uptime values describe current state,
+    // send them only with live measurements.
+    if (w->live) {
 
-        jsonWriteKey(s, name);
+      payloadKey(p, "rssi");
+      payloadInteger(p, rssi);
+      payloadKey(p, "noise");
+      payloadInteger(p, noise);
+      payloadKey(p, "uptime");
+      payloadInteger(p, getUptime());
 
-        {
-          JsonNode* values;
-          int i;
-          float v;
+      if (sensorOverflows > 0) {
 
-          values = jsonStartArray(s);
+        payloadKey(p, "overflow");
+        payloadInteger(p, sensorOverflows);
+      }
 
-          for (i = 0; i < sensor->historyCount; i++) {
+      int lct = getLastCycleTime();
 
-            v = sensor->temperature[i];
-            if (v <= -272)
-              jsonWriteNull(values);
-            else
-              jsonWriteDouble(values, v);
-          }
-        }
+      if (lct > 0) {
+
+        payloadKey(p, "cycleTime");
+        payloadInteger(p, lct);
       }
-    }
 
-    if (nodeLocation != NULL) {
+      if (spoolPending() > 0) {
 
-      jsonWriteKey(locations, nodeLocation);
+        payloadKey(p, "spooled");
+        payloadInteger(p, spoolPending());
+      }
 
-      {
-        JsonNode* s;
+      const CycleTiming* timing = timingLast();
 
-        s = jsonStartObject(locations);
+      if (metrics && timing != NULL) {
 
-        jsonWriteKey(s, "rssi");
-        jsonWriteInteger(s, rssi);
-        jsonWriteKey(s, "noise");
-        jsonWriteInteger(s, noise);
-        jsonWriteKey(s, "uptime");
-        jsonWriteInteger(s, getUptime());
+        payloadKey(p, "phases");
+        payloadStartObject(p);
 
-        int lct = getLastCycleTime();
+        for (i = 0; i < PHASE_COUNT; i++) {
 
-        if (lct > 0) {
+          if (timing->phase[i] == 0)
+            continue;
 
-          jsonWriteKey(s, "cycleTime");
-          jsonWriteInteger(s, lct);
+          payloadKey(p, timingPhaseName(i));
+          payloadInteger(p, timing->phase[i]);
         }
 
-        // Update battery reading with Wifi on status.
-        updateLastBatteryReading();
-
-        // Check if we have battery at all
-        bool haveBattery = false;
-        int i;
+        payloadEndObject(p);
+      }
 
-        sensor = sensorList;
-        for (i = 0; !haveBattery && i < sensor->historyCount; i++)
-          haveBattery = isValidBattery(sensor->temperature[i]);
+      const EnergyCycle* energy = energyLast();
 
-        sensor = sensorList;
-        if (haveBattery) {
+      if (metrics && energy != NULL) {
 
-          jsonWriteKey(s, "battery");
+        payloadKey(p, "energy");
+        payloadStartObject(p);
+        payloadKey(p, "uAh");
+        payloadInteger(p, (int)(energy->total + 0.5));
 
-          {
-            JsonNode* values;
+        int days = energyLifeDays();
 
-            values = jsonStartArray(s);
+        if (days >= 0) {
 
-            for (i = 0; i < sensor->historyCount; i++)
-              jsonWriteDouble(values, sensor->temperature[i]);
-          }
+          payloadKey(p, "days");
+          payloadInteger(p, days);
         }
+
+        payloadEndObject(p);
       }
     }
+
+    // Check if we have battery at all
+    bool haveBattery = false;
+
+    sensor = w->sensors;
+    for (i = 0; !haveBattery && i < sensor->historyCount; i++)
+      haveBattery = isValidBattery(batteryVolts(sensorHistory(sensor, i)));
+
+    if (haveBattery) {
+
+      payloadKey(p, "battery");
+      payloadStartArray(p);
+
+      for (i = 0; i < sensor->historyCount; i++)
+        payloadDouble(p, batteryVolts(sensorHistory(sensor, i)));
+
+      payloadEndArray(p);
+    }
+
+    payloadEndObject(p);
   }
 
-  jsonGenerateFlush(top);
+  payloadEndObject(p);
+  payloadEndObject(p);
+}
 
-  if (jsonFailed(&jsonCtx))
+/*
+ * Publish one measurement window. Payload size is
+ * computed first and buffer is allocated for it, so
+ * memory is needed only while publishing.
+ */
+static bool publishWindow(const Window* w, const char* topic, const char* nodeLocation)
+{
+  PbPublish pub = {};
+  Payload   p;
+  int       status;
+  int32_t   rssi = 0;
+  int32_t   noise = 0;
+  int       format = payloadFormat();
+  bool      delta = deltaEncoding();
+  bool      metrics = sendMetrics();
+  JIF_t     start = jiffies;
+
+  if (w->live) {
+
+    wwd_wifi_get_rssi(&rssi);
+    wwd_wifi_get_noise(&noise);
+  }
+
+  payloadInit(&p, NULL, 0, format);
+  buildPayload(&p, w, nodeLocation, delta, metrics, rssi, noise);
+
+  pub.len = p.len;
+  pub.message = nosMemAlloc(pub.len);
+  if (pub.message == NULL) {
+
+    printf("potato: no memory for %d byte payload\n", pub.len);
+    return false;
+  }
+
+  payloadInit(&p, (uint8_t*)pub.message, pub.len, format);
+  buildPayload(&p, w, nodeLocation, delta, metrics, rssi, noise);
+  if (p.overflow || p.len != pub.len) {
+
+    printf("potato: payload size changed from %d to %d bytes\n", pub.len, p.len);
+    nosMemFree((void*)pub.message);
+    return false;
+  }
+
+  pub.topic = (char*)(topic != NULL ? topic : "test");
+
+  energyOn(ENERGY_TX);
+  status = pbPublish(&client, &pub);
+  energyOff(ENERGY_TX);
+  nosMemFree((void*)pub.message);
+  timingPhase(PHASE_PUBLISH, start);
+  if (status < 0) {
+
+    printf("potato: publish failed, error %d\n", status);
     return false;
+  }
 
   return true;
 }
 
-bool potatoSend()
+static bool connected = false;
+static POSMUTEX_t connLock;
+
+/*
+ * Resolve server name before connecting, so that time
+ * used by DNS can be told apart from connection setup.
+ * Answer is cached by lwip for pbConnect.
+ */
+static bool resolveServer(const char* server)
+{
+  char        host[64];
+  const char* start;
+  int         len;
+  ip_addr_t   addr;
+  err_t       err;
+
+  start = strstr(server, "://");
+  start = (start != NULL) ? start + 3 : server;
+  len = strcspn(start, ":/");
+  if (len >= (int)sizeof(host))
+    return true; // let pbConnect deal with it
+
+  memcpy(host, start, len);
+  host[len] = '\0';
+  err = netconn_gethostbyname(host, &addr);
+  if (err != ERR_OK) {
+
+    printf("potato: cannot resolve %s, error %d\n", host, err);
+    return false;
+  }
+
+  return true;
+}
+
+static bool potatoConnect(const char* server)
 {
-  const char* server = uosConfigGet("mqtt.server");
-  const char* topic  = uosConfigGet("mqtt.topic");
-  const char* nodeLocation = (char*)uosConfigGet("mqtt.node");
-  char addr[80];
   int   status;
-  
-  if (server == NULL)
-    return true;
+  JIF_t start;
 
 #if POTATO_TLS
 
@@ -413,9 +604,20 @@ bool potatoSend()
 
 #endif
 
-  ADC_Cmd(ADC1, ENABLE); // Enable ADC now so it has time to settle.
+  start = jiffies;
+  if (!resolveServer(server)) {
+
+    timingPhase(PHASE_DNS, start);
+    return false;
+  }
 
+  timingPhase(PHASE_DNS, start);
+
+  start = jiffies;
+  energyOn(ENERGY_TX);
   status = pbConnect(&client, server, &connectArgs);
+  energyOff(ENERGY_TX);
+  timingPhase(PHASE_CONNECT, start);
   if (status < 0) {
 
     printf("potato: connect failed, error %d\n", status);
@@ -424,8 +626,10 @@ bool potatoSend()
 
       printf("        SSL error 0x%X\n", client.sslResult);
 #ifdef MBEDTLS_ERROR_C
-      mbedtls_strerror(client.sslResult, jsonBuf, sizeof(jsonBuf));
-      printf("        %s\n", jsonBuf);
+      char msg[80];
+
+      mbedtls_strerror(client.sslResult, msg, sizeof(msg));
+      printf("        %s\n", msg);
 #endif
 
     }
@@ -434,26 +638,102 @@ bool potatoSend()
     return false;
   }
 
-  PbPublish pub = {};
+  connected = true;
+  return true;
+}
 
-  if (buildJson(nodeLocation)) {
+static void potatoDisconnect()
+{
+  if (connected)
+    pbDisconnect(&client);
 
-    pub.message = (uint8_t*)jsonBuf;
-    pub.len = strlen(jsonBuf);
+  connected = false;
+}
 
-    if (topic == NULL)
-      strcpy(addr, "test");
-    else {
+/*
+ * Close persistent connection, for example when
+ * wifi link has been lost and connection is dead.
+ */
+void potatoClose()
+{
+  nosMutexLock(connLock);
+  potatoDisconnect();
+  nosMutexUnlock(connLock);
+}
 
-      strcpy(addr, topic);
-    }
+void potatoInit()
+{
+  sprintf(clientId, "EMW%02x%02x%02x%02x%02x%02x", myMac.octet[0],
+                    myMac.octet[1], myMac.octet[2], myMac.octet[3],
+                    myMac.octet[4], myMac.octet[5]);
+
+  connectArgs.clientId = clientId;
+
+  // Persistent connection is kept alive by measurement
+  // publishes, broker allows 1.5 * keepAlive between them.
+  connectArgs.keepAlive = staIsAlwaysOnline() ? MQTT_KEEPALIVE_SECS : 60;
+
+  connLock = nosMutexCreate(0, "mqtt");
+}
+
+bool potatoSend()
+{
+  const char* server = uosConfigGet("mqtt.server");
+  const char* topic  = uosConfigGet("mqtt.topic");
+  const char* nodeLocation = (char*)uosConfigGet("mqtt.node");
+  bool  persistent = staIsAlwaysOnline();
+  Window w;
+  bool  ok;
+  bool  spoolOk;
+  JIF_t deadline;
+  
+  if (server == NULL)
+    return true;
+
+  // Update battery reading with Wifi on status. Only once,
+  // live window may be published twice.
+  updateLastBatteryReading();
+
+  nosMutexLock(connLock);
+  if (!connected && !potatoConnect(server)) {
 
-    pub.topic = addr;
-    pbPublish(&client, &pub);
+    nosMutexUnlock(connLock);
+    return false;
   }
 
-  pbDisconnect(&client);
-  return true;
+  sensorWindow(&w);
+  ok = publishWindow(&w, topic, nodeLocation);
+  if (!ok && persistent) {
+
+    // Persistent connection may have died while idle,
+    // reconnect once.
+    potatoDisconnect();
+    if (potatoConnect(server))
+      ok = publishWindow(&w, topic, nodeLocation);
+  }
+
+  // Connection is up, drain windows stored during
+  // earlier failures, oldest first, in same session.
+  // Stop if time budget for this cycle runs out.
+  deadline = jiffies + MS(sendBudget() * 1000);
+  spoolOk = ok;
+  while (spoolOk && POS_TIMEAFTER(deadline, jiffies) && spoolRead(&w)) {
+
+    spoolOk = publishWindow(&w, topic, nodeLocation);
+    spoolFree(&w);
+    if (spoolOk)
+      spoolAck();
+  }
+
+  if (spoolPending() > 0)
+    logPrintf("%d spooled windows left for next cycle.\n", spoolPending());
+
+  spoolSync();
+  if (!persistent || !spoolOk)
+    potatoDisconnect();
+
+  nosMutexUnlock(connLock);
+  return ok;
 }
 
 #endif
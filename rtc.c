@@ -0,0 +1,223 @@
+/*
+ * Copyright (c) 2019, Ari Suutari <ari@stonepile.fi>.
+ * All rights reserved. 
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 
+ *  1. Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *  3. The name of the author may not be used to endorse or promote
+ *     products derived from this software without specific prior written
+ *     permission. 
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS
+ * OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT,
+ * INDIRECT,  INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Wall clock in RTC calendar. RTC is clocked from LSE
+ * and keeps running over STOP mode and system resets,
+ * so time set by SNTP is written to it and restored
+ * from it at startup. Backup registers tell whether
+ * calendar has been set and when it was last synchronized.
+ *
+ * Calendar also serves as reference for jiffies, which
+ * are compensated by port after each tickless sleep.
+ */
+
+#include <picoos.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <string.h>
+#include <time.h>
+#include <sys/time.h>
+
+#include "emw-sensor.h"
+
+#define RTC_MAGIC    0x454d5752  // "EMWR"
+#define RTC_BKP_SYNC RTC_BKP_DR1
+#define RTC_BKP_FRAC RTC_BKP_DR2
+
+#define TICK_DRIFT_WARN_MS 2000
+
+static JIF_t   checkJiffies;
+static time_t  checkTime;
+static int64_t tickDrift;      // ms, jiffies ahead of calendar
+static int     tickBacksteps;
+static bool    tickWarned;
+
+/*
+ * Days since 1970-01-01 for a date in proleptic
+ * Gregorian calendar.
+ */
+static int32_t daysFromCivil(int y, int m, int d)
+{
+  int      era;
+  unsigned yoe, doy, doe;
+
+  y -= m <= 2;
+  era = y / 400;
+  yoe = (unsigned)(y - era * 400);
+  doy = (153 * (m + (m > 2 ? -3 : 9)) + 2) / 5 + d - 1;
+  doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+  return era * 146097 + (int32_t)doe - 719468;
+}
+
+static time_t rtcRead()
+{
+  RTC_TimeTypeDef rtcTime;
+  RTC_DateTypeDef rtcDate;
+
+  // Shadow registers are stale after wakeup from STOP.
+  RTC_WaitForSynchro();
+
+  // Reading time register locks date until it is read.
+  RTC_GetTime(RTC_Format_BIN, &rtcTime);
+  RTC_GetDate(RTC_Format_BIN, &rtcDate);
+
+  return (time_t)daysFromCivil(2000 + rtcDate.RTC_Year, rtcDate.RTC_Month, rtcDate.RTC_Date) * 86400 +
+         rtcTime.RTC_Hours * 3600 + rtcTime.RTC_Minutes * 60 + rtcTime.RTC_Seconds;
+}
+
+/*
+ * Restore system time from RTC if calendar has been
+ * set earlier. Calendar seconds started at fraction
+ * of second saved in backup register. It is not known
+ * how far into current second calendar is, so middle
+ * of it is used, giving error of at most half a second.
+ */
+void rtcInit()
+{
+  struct timeval tv;
+  char buf[30];
+
+  PWR_BackupAccessCmd(ENABLE);
+  if (RTC_ReadBackupRegister(RTC_BKP_DR0) != RTC_MAGIC)
+    return;
+
+  tv.tv_sec = rtcRead();
+  tv.tv_usec = RTC_ReadBackupRegister(RTC_BKP_FRAC) % 1000000 + 500000;
+  if (tv.tv_usec >= 1000000) {
+
+    tv.tv_sec++;
+    tv.tv_usec -= 1000000;
+  }
+
+  if (tv.tv_sec <= T_2017_01_01)
+    return;
+
+  settimeofday(&tv, NULL);
+  ctime_r(&tv.tv_sec, buf);
+  printf("Clock restored from RTC: %s", buf);
+}
+
+/*
+ * Write system time to RTC calendar. Calendar has
+ * one second resolution, fraction is saved in backup
+ * register.
+ */
+void rtcSetTime(const struct timeval* tv)
+{
+  RTC_TimeTypeDef rtcTime;
+  RTC_DateTypeDef rtcDate;
+  struct tm tm;
+
+  gmtime_r(&tv->tv_sec, &tm);
+  if (tm.tm_year < 100 || tm.tm_year > 199)
+    return;
+
+  rtcTime.RTC_H12     = RTC_H12_AM;
+  rtcTime.RTC_Hours   = tm.tm_hour;
+  rtcTime.RTC_Minutes = tm.tm_min;
+  rtcTime.RTC_Seconds = tm.tm_sec;
+
+  rtcDate.RTC_WeekDay = tm.tm_wday == 0 ? 7 : tm.tm_wday;
+  rtcDate.RTC_Month   = tm.tm_mon + 1;
+  rtcDate.RTC_Date    = tm.tm_mday;
+  rtcDate.RTC_Year    = tm.tm_year - 100;
+
+  PWR_BackupAccessCmd(ENABLE);
+  if (RTC_SetTime(RTC_Format_BIN, &rtcTime) != SUCCESS ||
+      RTC_SetDate(RTC_Format_BIN, &rtcDate) != SUCCESS) {
+
+    logPrintf("RTC calendar update failed.\n");
+    RTC_WriteBackupRegister(RTC_BKP_DR0, 0);
+    return;
+  }
+
+  RTC_WriteBackupRegister(RTC_BKP_FRAC, (uint32_t)tv->tv_usec);
+  RTC_WriteBackupRegister(RTC_BKP_DR0, RTC_MAGIC);
+  checkTime = 0;
+}
+
+/*
+ * Time of last SNTP synchronization is kept in
+ * backup register, so clock confidence survives resets.
+ */
+void rtcSetLastSync(time_t t)
+{
+  PWR_BackupAccessCmd(ENABLE);
+  RTC_WriteBackupRegister(RTC_BKP_SYNC, (uint32_t)t);
+}
+
+time_t rtcLastSync()
+{
+  if (RTC_ReadBackupRegister(RTC_BKP_DR0) != RTC_MAGIC)
+    return 0;
+
+  return (time_t)RTC_ReadBackupRegister(RTC_BKP_SYNC);
+}
+
+/*
+ * Compare jiffies elapsed since last check with calendar.
+ * Called once per cycle, so interval includes the sleep
+ * between cycles. Calendar resolution cancels out
+ * in accumulated drift.
+ */
+void rtcTickCheck()
+{
+  JIF_t  now = jiffies;
+  time_t t = rtcRead();
+  int32_t elapsed;
+
+  if (checkTime != 0) {
+
+    elapsed = (int32_t)(now - checkJiffies);
+    if (elapsed < 0)
+      ++tickBacksteps;
+
+    tickDrift += (int64_t)elapsed * 1000 / HZ - (int64_t)(t - checkTime) * 1000;
+    if (!tickWarned && (tickDrift > TICK_DRIFT_WARN_MS || tickDrift < -TICK_DRIFT_WARN_MS)) {
+
+      logPrintf("Jiffies off by %d ms from RTC.\n", (int)tickDrift);
+      tickWarned = true;
+    }
+  }
+
+  checkJiffies = now;
+  checkTime = t;
+}
+
+int rtcTickDrift()
+{
+  return (int)tickDrift;
+}
+
+int rtcTickBacksteps()
+{
+  return tickBacksteps;
+}
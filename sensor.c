@@ -33,6 +33,8 @@
 #include <stdio.h>
 #include <stdbool.h>
 #include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
 #include <sys/time.h>
 #include "emw-sensor.h"
 
@@ -65,38 +67,270 @@ void owStr2Addr(uint8_t* addr, const char* buf)
   }
 }
 
+/*
+ * DS18x20 commands.
+ */
+#define OW_SKIP_ROM           0xCC
+#define DS_CONVERT_T          0x44
+#define DS_READ_SCRATCHPAD    0xBE
+#define DS_WRITE_SCRATCHPAD   0x4E
+#define DS_COPY_SCRATCHPAD    0x48
+
+#define DS18S20_FAMILY        0x10
+#define DS_CONVERSION_MS      750
+#define DS_DEFAULT_BITS       12
+#define DS_CONFIG(bits)       ((((bits) - 9) << 5) | 0x1F)
+#define DS_CONFIG_BITS(cfg)   ((((cfg) >> 5) & 3) + 9)
+
+/*
+ * Conversion time of DS18B20 is halved for
+ * each bit of resolution dropped.
+ */
+static int conversionTime(const uint8_t* addr, int bits)
+{
+  if (addr[0] == DS18S20_FAMILY)
+    return DS_CONVERSION_MS;
+
+  return DS_CONVERSION_MS >> (DS_DEFAULT_BITS - bits);
+}
+
+static int conversionWaited;
+
+/*
+ * Start temperature conversion on all devices on bus
+ * with a single skip rom command and sleep until
+ * conversion is complete. Bus is kept in strong pullup
+ * during conversion in case there are parasite-powered
+ * sensors.
+ */
+static bool convertAll(int ms)
+{
+  conversionWaited = 0;
+  if (!owTouchReset(0))
+    return false;
+
+  if (!owWriteByte(0, OW_SKIP_ROM))
+    return false;
+
+  if (!owWriteBytePower(0, DS_CONVERT_T))
+    return false;
+
+  posTaskSleep(MS(ms));
+  conversionWaited = ms;
+
+  return owLevel(0, MODE_NORMAL) == MODE_NORMAL;
+}
+
+/*
+ * Read scratchpad of given device.
+ */
+static bool readScratchpad(uint8_t* serialNum, uint8_t* pad)
+{
+  uint8_t block[10];
+  uint8_t crc = 0;
+  int     i;
+
+  owSerialNum(0, serialNum, FALSE);
+  if (!owAccess(0))
+    return false;
+
+  block[0] = DS_READ_SCRATCHPAD;
+  memset(block + 1, 0xFF, sizeof(block) - 1);
+
+  if (!owBlock(0, FALSE, block, sizeof(block)))
+    return false;
+
+  setcrc8(0, 0);
+  for (i = 1; i < (int)sizeof(block); i++)
+    crc = docrc8(0, block[i]);
+
+  if (crc != 0)
+    return false;
+
+  memcpy(pad, block + 1, 9);
+  return true;
+}
+
+/*
+ * Set resolution of DS18B20 and copy it to eeprom
+ * so it survives power loss.
+ */
+static bool configureSensor(uint8_t* serialNum, int bits)
+{
+  uint8_t pad[9];
+  uint8_t block[4];
+
+  if (!readScratchpad(serialNum, pad))
+    return false;
+
+  if (DS_CONFIG_BITS(pad[4]) == bits)
+    return true;
+
+  block[0] = DS_WRITE_SCRATCHPAD;
+  block[1] = pad[2]; // keep alarm registers
+  block[2] = pad[3];
+  block[3] = DS_CONFIG(bits);
+
+  if (!owAccess(0) || !owBlock(0, FALSE, block, sizeof(block)))
+    return false;
+
+  if (!owAccess(0) || !owWriteBytePower(0, DS_COPY_SCRATCHPAD))
+    return false;
+
+  posTaskSleep(MS(10));
+  return owLevel(0, MODE_NORMAL) == MODE_NORMAL;
+}
+
+/*
+ * Read result of previous conversion from
+ * scratchpad of given device.
+ */
+static bool readTemperature(Sensor* sensor, uint8_t* serialNum, int16_t* value)
+{
+  uint8_t pad[9];
+  int16_t raw;
+  int     bits;
+
+  if (!readScratchpad(serialNum, pad))
+    return false;
+
+  raw = (int16_t)(pad[0] | (pad[1] << 8));
+  if (serialNum[0] == DS18S20_FAMILY) {
+
+    // Convert 0.5 C reading to 1/16 C units using count remain.
+    raw = (raw & ~1) * 8 - 4 + (16 - pad[6]);
+  }
+  else {
+
+    bits = DS_CONFIG_BITS(pad[4]);
+    if (bits != sensor->resolution)
+      sensor->configPending = true;
+
+    // Conversion was not complete at this resolution.
+    if (conversionTime(serialNum, bits) > conversionWaited)
+      return false;
+
+    // Lowest bits are undefined with reduced resolution.
+    raw &= ~((1 << (DS_DEFAULT_BITS - bits)) - 1);
+  }
+
+  *value = raw;
+  return true;
+}
+
 static POSMUTEX_t sensorMutex;
 static POSSEMA_t timerSema;
 static POSTIMER_t timer;
 
-Sensor     sensorList[MAX_SENSORS];
+Sensor*    sensorList;
 int        sensorCount;
+int        sensorCapacity;
 time_t     sensorTime;
 
-static Sensor* getSensor(uint8_t* addr)
+/*
+ * Open addressing hash index to sensor table,
+ * keyed by 1-wire address. Size is a power of two
+ * at least twice the table capacity, so probe
+ * sequences stay short.
+ */
+static int16_t* sensorIndex;
+static int      sensorIndexSize;
+
+static unsigned int addrHash(const uint8_t* addr)
 {
+  unsigned int h = 2166136261u;
   int i;
+
+  for (i = 0; i < 7; i++)
+    h = (h ^ addr[i]) * 16777619u;
+
+  return h;
+}
+
+static void sensorAlloc()
+{
+  const char* val = uosConfigGet("ow.max");
+  int   size;
+  int   i;
+  char* arena;
+
+  sensorCapacity = DEFAULT_MAX_SENSORS;
+  if (val != NULL && val[0] != '\0')
+    sensorCapacity = strtol(val, NULL, 10);
+
+  if (sensorCapacity < 1 || sensorCapacity > MAX_SENSORS_LIMIT)
+    sensorCapacity = DEFAULT_MAX_SENSORS;
+
+  ++sensorCapacity; // slot 0 is battery voltage
+
+  for (size = 4; size < 2 * sensorCapacity; size *= 2);
+  sensorIndexSize = size;
+
+  arena = nosMemAlloc(sensorCapacity * sizeof(Sensor) + size * sizeof(int16_t));
+  P_ASSERT("sensorAlloc", arena != NULL);
+
+  memset(arena, '\0', sensorCapacity * sizeof(Sensor));
+  sensorList = (Sensor*)arena;
+  sensorIndex = (int16_t*)(arena + sensorCapacity * sizeof(Sensor));
+  for (i = 0; i < size; i++)
+    sensorIndex[i] = -1;
+}
+
+/*
+ * Find index slot for address. Returns either slot
+ * containing the sensor or empty slot where it should be added.
+ */
+static unsigned int findSlot(const uint8_t* addr)
+{
+  unsigned int slot;
   Sensor* sensor;
 
-  sensor = sensorList + 1;
-  // slot 0 is battery voltage
-  for (i = 1; i < sensorCount; i++, sensor++) {
+  slot = addrHash(addr) & (sensorIndexSize - 1);
+  while (sensorIndex[slot] != -1) {
 
+    sensor = sensorList + sensorIndex[slot];
     if (!memcmp(addr, sensor->addr, sizeof(sensor->addr)))
-      return sensor;
+      break;
+
+    slot = (slot + 1) & (sensorIndexSize - 1);
   }
 
-  if (sensorCount == MAX_SENSORS) {
+  return slot;
+}
+
+Sensor* sensorFind(const uint8_t* addr)
+{
+  unsigned int slot = findSlot(addr);
+
+  if (sensorIndex[slot] == -1)
+    return NULL;
+
+  return sensorList + sensorIndex[slot];
+}
+
+static Sensor* getSensor(uint8_t* addr)
+{
+  unsigned int slot;
+  Sensor* sensor;
+
+  slot = findSlot(addr);
+  if (sensorIndex[slot] != -1)
+    return sensorList + sensorIndex[slot];
+
+  if (sensorCount == sensorCapacity) {
     
     printf("Too many sensors.\n");
     return NULL;
   }
 
   sensorLock();
+  sensorIndex[slot] = sensorCount;
   sensor = sensorList + sensorCount;
   memcpy(sensor->addr, addr, sizeof(sensor->addr));
   sensorCount++;
+  sensor->historyHead = 0;
   sensor->historyCount = 0;
+  sensor->present = false;
 
   char serialStr[20];
   char key[36];
@@ -119,6 +353,21 @@ static Sensor* getSensor(uint8_t* addr)
     sensor->veraId = strtol(val, NULL, 10);
 #endif
 
+  strcpy(key, "or.");
+  strcat(key, serialStr);
+  val = uosConfigGet(key);
+  sensor->resolution = DS_DEFAULT_BITS;
+  sensor->configPending = false;
+  if (val != NULL && val[0] != '\0') {
+
+    sensor->resolution = strtol(val, NULL, 10);
+    if (sensor->resolution < 9 || sensor->resolution > DS_DEFAULT_BITS)
+      sensor->resolution = DS_DEFAULT_BITS;
+
+    // Check device configuration before first conversion.
+    sensor->configPending = (addr[0] != DS18S20_FAMILY);
+  }
+
   sensorUnlock();
  
   return sensor;
@@ -140,52 +389,187 @@ void sensorCycleReset(const struct timeval* now)
   posTimerStart(timer);
 }
 
+/*
+ * When history is full, either oldest samples are dropped
+ * or every other sample is discarded and measurement interval
+ * is doubled (decimate), so history covers a longer period
+ * with coarser time step.
+ */
+static bool decimate;
+static int  historyStep = 1;
+static int  stepCycles = 0;
+int         sensorOverflows = 0;
+
+int sensorTimeStep()
+{
+  return historyStep * MEAS_CYCLE_SECS;
+}
+
+/*
+ * Describe current sensor table as measurement window.
+ */
+void sensorWindow(Window* w)
+{
+  w->time     = sensorTime;
+  w->timeStep = sensorTimeStep();
+  w->count    = sensorCount;
+  w->sensors  = sensorList;
+  w->live     = true;
+}
+
 void sensorClearHistory()
 {
   Sensor* sensor;
   int ns;
 
   sensor = sensorList;
-  for (ns = 0; ns < sensorCount; ns++, sensor++)
+  for (ns = 0; ns < sensorCount; ns++, sensor++) {
+
+    sensor->historyHead = 0;
     sensor->historyCount = 0;
+  }
+
+  historyStep = 1;
+}
+
+static bool historyFull()
+{
+  Sensor* sensor;
+  int ns;
+
+  sensor = sensorList;
+  for (ns = 0; ns < sensorCount; ns++, sensor++)
+    if (sensor->historyCount == MAX_HISTORY)
+      return true;
+
+  return false;
+}
+
+/*
+ * Drop every other sample from all histories. Samples
+ * are kept so that the next one is added after one
+ * (doubled) time step.
+ */
+static void decimateHistory()
+{
+  Sensor* sensor;
+  int ns;
+  int i;
+  int j;
+
+  sensorLock();
+  sensor = sensorList;
+  for (ns = 0; ns < sensorCount; ns++, sensor++) {
+
+    j = 0;
+    for (i = 0; i < sensor->historyCount; i++)
+      if ((sensor->historyCount - i) % 2 == 0)
+        sensorHistory(sensor, j++) = sensorHistory(sensor, i);
+
+    sensorOverflows += sensor->historyCount - j;
+    sensor->historyCount = j;
+  }
+
+  historyStep *= 2;
+  sensorUnlock();
+  printf("Sensor history was full, time step now %d s.\n", sensorTimeStep());
 }
 
-float battery;
+int16_t battery;
 static int adcFailures = 0;
+static POSSEMA_t adcSema;
+static uint16_t adcSamples[BATTERY_OVERSAMPLE];
+
+/*
+ * Lower limit is what a missing battery reads, upper
+ * limit means that reading is clipped by ADC reference.
+ */
+#define BATTERY_MIN_VOLTS 0.5
+#define BATTERY_MAX_VOLTS (BATTERY_VREF - 0.01)
 
 bool isValidBattery(double v)
 {
-  return v > 0.1;
+  return v > BATTERY_MIN_VOLTS && v < BATTERY_MAX_VOLTS;
 }
 
-static void readBattery()
+double batteryVolts(int16_t counts)
 {
-  ADC_SoftwareStartConv(ADC1);
+  if (counts == SAMPLE_INVALID)
+    return -1;
+
+  return counts * BATTERY_VREF / BATTERY_ADC_COUNTS;
+}
 
-  int timeout = 500;
-  while (ADC_GetFlagStatus(ADC1, ADC_FLAG_EOC ) == RESET) {
+/*
+ * DMA has transferred all battery samples.
+ */
+void DMA2_Stream0_irq()
+{
+  c_pos_intEnter();
 
-    posTaskSleep(MS(1));
-    timeout -= 1;
-    if (timeout <= 0) {
+  if (DMA_GetITStatus(DMA2_Stream0, DMA_IT_TCIF0) != RESET) {
 
-      ++adcFailures;
-      logPrintf("ADC timeout.\n");
-      battery = -1;
-      return;
-    }
+    DMA_ClearITPendingBit(DMA2_Stream0, DMA_IT_TCIF0);
+    posSemaSignal(adcSema);
   }
 
+  c_pos_intExit();
+}
+
+/*
+ * Run BATTERY_OVERSAMPLE conversions into adcSamples
+ * with DMA. Task sleeps until transfer complete interrupt.
+ * ADC is powered only for the duration of reading.
+ */
+static void readBattery()
+{
+  uint32_t sum;
+  int      i;
+
+  ADC_Cmd(ADC1, ENABLE);
+  energyOn(ENERGY_ADC);
+
+  // Let ADC and battery divider stabilize.
+  posTaskSleep(MS(2));
+
+  while (nosSemaWait(adcSema, 0) == 0);
 
-  int result;
+  DMA_Cmd(DMA2_Stream0, DISABLE);
+  while (DMA_GetCmdStatus(DMA2_Stream0) != DISABLE);
 
-  result = ADC_GetConversionValue(ADC1);
+  DMA_ClearFlag(DMA2_Stream0, DMA_FLAG_TCIF0 | DMA_FLAG_TEIF0 | DMA_FLAG_HTIF0 | DMA_FLAG_FEIF0 | DMA_FLAG_DMEIF0);
+  DMA_SetCurrDataCounter(DMA2_Stream0, BATTERY_OVERSAMPLE);
+  DMA_Cmd(DMA2_Stream0, ENABLE);
 
-  battery = result * 3.3 / 256;
-  if (isValidBattery(battery))
-    logPrintf ("Battery         = %f V\n", battery);
+  // Re-arm DMA requests, they stop after last transfer.
+  ADC_DMACmd(ADC1, DISABLE);
+  ADC_ClearFlag(ADC1, ADC_FLAG_OVR | ADC_FLAG_EOC);
+  ADC_DMACmd(ADC1, ENABLE);
+
+  ADC_SoftwareStartConv(ADC1);
+
+  if (nosSemaWait(adcSema, MS(50)) != 0) {
+
+    ++adcFailures;
+    logPrintf("ADC timeout.\n");
+    battery = SAMPLE_INVALID;
+
+    // Stop continuous conversions.
+    ADC_Cmd(ADC1, DISABLE);
+    energyOff(ENERGY_ADC);
+    return;
+  }
+
+  sum = 0;
+  for (i = 0; i < BATTERY_OVERSAMPLE; i++)
+    sum += adcSamples[i];
+
+  battery = sum / (BATTERY_OVERSAMPLE / 4);
+  if (isValidBattery(batteryVolts(battery)))
+    logPrintf ("Battery         = %f V\n", batteryVolts(battery));
 
   ADC_Cmd(ADC1, DISABLE);
+  energyOff(ENERGY_ADC);
 }
 
 void updateLastBatteryReading()
@@ -198,124 +582,396 @@ void updateLastBatteryReading()
   if (sensor->historyCount == MAX_HISTORY)
     sensor->historyCount--;
 
-  sensor->temperature[sensor->historyCount] = battery;
+  sensorHistory(sensor, sensor->historyCount) = battery;
   sensor->historyCount++;
 }
 
-static void sensorThread(void* arg)
+/*
+ * Add a value to sensor history. Returns true if history
+ * is full and should be sent.
+ */
+static bool addHistory(Sensor* sensor, int16_t value)
 {
-  int	  result;
-  uint8_t serialNum[8];
-  char buf[30];
-  float   value;
+  bool full;
+
+  sensorLock();
+  if (sensor->historyCount >= MAX_HISTORY) {
+
+    sensor->historyHead = (sensor->historyHead + 1) % MAX_HISTORY;
+    sensor->historyCount--;
+    ++sensorOverflows;
+    printf("Sensor history was full.\n");
+  }
+
+  sensorHistory(sensor, sensor->historyCount) = value;
+  sensor->historyCount++;
+  full = (sensor->historyCount == MAX_HISTORY);
+
+  sensorUnlock();
+  return full;
+}
+
+/*
+ * Read sensor value from scratchpad and log it.
+ * Returns SAMPLE_INVALID if reading failed.
+ */
+static int16_t sampleSensor(Sensor* sensor, uint8_t* serialNum)
+{
+  char    buf[20];
+  int16_t value;
+  float   c;
+
+  // 85 C is power-on reset value of scratchpad.
+  if (!readTemperature(sensor, serialNum, &value) || value >= 85 * 16)
+    value = SAMPLE_INVALID;
+
+  owAddr2Str(buf, serialNum);
+  c = (value == SAMPLE_INVALID) ? -273 : sampleToCelsius(value);
+
+#if USE_MQTT && USE_VERA
+  logPrintf("%s = %f [%s] #%d\n", buf, c, sensor->location ? sensor->location : "", sensor->veraId);
+#elif USE_MQTT
+  logPrintf("%s = %f [%s]\n", buf, c, sensor->location ? sensor->location : "");
+#elif USE_VERA
+  logPrintf("%s = %f #%d\n", buf, c, sensor->veraId);
+#else
+  logPrintf("%s = %f\n", buf, c);
+#endif
+
+  return value;
+}
+
+/*
+ * Known devices on bus. Full ROM search is performed
+ * only when inventory is too old, when reading from some
+ * device failed or when onewire shell command requests it.
+ */
+#define INVENTORY_FILE      "/flash/onewire.inv"
+#define DEFAULT_RESCAN_MINS (24 * 60)
+
+static bool rescanNeeded = true;
+static bool inventoryDirty = false;
+static int  cyclesSinceScan = 0;
+
+static uint8_t owRomCrc(const uint8_t* addr)
+{
+  uint8_t crc = 0;
+  int     i;
+
+  setcrc8(0, 0);
+  for (i = 0; i < 7; i++)
+    crc = docrc8(0, addr[i]);
+
+  return crc;
+}
+
+static int rescanCycles()
+{
+  const char* val = uosConfigGet("ow.rescan");
+  int mins = DEFAULT_RESCAN_MINS;
+
+  if (val != NULL && val[0] != '\0')
+    mins = strtol(val, NULL, 10);
+
+  return mins * 60 / MEAS_CYCLE_SECS;
+}
+
+static void loadInventory()
+{
+  int     fd;
+  uint8_t rom[8];
   Sensor* sensor;
-  bool sendNeeded = true;
-  time_t  now;
-  struct timeval tv;
-  bool    online = staIsAlwaysOnline();
 
-  timerSema = nosSemaCreate(0, 0, "sensor*");
-  timer     = posTimerCreate();
+  fd = open(INVENTORY_FILE, O_RDONLY);
+  if (fd == -1)
+    return;
 
-  gettimeofday(&tv, NULL);
-  sensorCycleReset(&tv);
+  while (read(fd, rom, sizeof(rom)) == sizeof(rom)) {
 
-  while (true) {
+    if (owRomCrc(rom) != rom[7])
+      continue;
 
-    int historyMax = 0;
+    sensor = getSensor(rom);
+    if (sensor == NULL)
+      break;
 
-    nosSemaGet(timerSema);
+    sensor->present = true;
+  }
 
-    time(&now);
-    ctime_r(&now, buf);
+  close(fd);
+  if (sensorCount > 1)
+    rescanNeeded = false;
+}
 
-    now = (now / MEAS_CYCLE_SECS) * MEAS_CYCLE_SECS;
-    if ((now % SEND_CYCLE_SECS) == 0)
-      sendNeeded = true;
+/*
+ * Save list of present devices to flash if it has
+ * changed. Must be called when flash is powered up.
+ */
+void sensorSaveInventory()
+{
+  int     fd;
+  int     ns;
+  uint8_t rom[8];
+  Sensor* sensor;
 
-    sensorTime = now;
+  if (!inventoryDirty)
+    return;
 
-    if (!sendNeeded && !online)
-      ADC_Cmd(ADC1, ENABLE); // Enable ADC now so it has time to settle.
+  inventoryDirty = false;
+  fd = open(INVENTORY_FILE, O_WRONLY | O_CREAT | O_TRUNC);
+  if (fd == -1) {
 
-    if (!owAcquire(0, NULL)) {
+    printf("Cannot open " INVENTORY_FILE ".\n");
+    return;
+  }
 
-      printf("OneWire: owAcquire failed\n");
+  sensorLock();
+  sensor = sensorList + 1;
+  for (ns = 1; ns < sensorCount; ns++, sensor++) {
+
+    if (!sensor->present)
       continue;
+
+    memcpy(rom, sensor->addr, sizeof(sensor->addr));
+    rom[7] = owRomCrc(rom);
+    if (write(fd, rom, sizeof(rom)) != sizeof(rom)) {
+
+      printf("Cannot write " INVENTORY_FILE ".\n");
+      break;
     }
+  }
+
+  sensorUnlock();
+  close(fd);
+}
+
+/*
+ * Set resolution of sensors that don't match configuration.
+ */
+static void configureSensors()
+{
+  int     ns;
+  uint8_t serialNum[8];
+  Sensor* sensor;
 
-    result = owFirst(0, TRUE, FALSE);
-    while (result) {
+  sensor = sensorList + 1;
+  for (ns = 1; ns < sensorCount; ns++, sensor++) {
 
-      owSerialNum(0, serialNum, TRUE);
-      sensor = getSensor(serialNum);
-      if (sensor == NULL)
-        break;
+    if (!sensor->present || !sensor->configPending)
+      continue;
 
-      if (!ReadTemperature(0, serialNum, &value) || value >= 85.0)
-        value = -273;
+    memcpy(serialNum, sensor->addr, sizeof(sensor->addr));
+    serialNum[7] = owRomCrc(serialNum);
 
-      owAddr2Str(buf, serialNum);
+    if (configureSensor(serialNum, sensor->resolution))
+      sensor->configPending = false;
+  }
+}
 
-#if USE_MQTT && USE_VERA
-      logPrintf("%s = %f [%s] #%d\n", buf, value, sensor->location ? sensor->location : "", sensor->veraId);
-#elif USE_MQTT
-      logPrintf("%s = %f [%s]\n", buf, value, sensor->location ? sensor->location : "");
-#elif USE_VERA
-      logPrintf("%s = %f #%d\n", buf, value, sensor->veraId);
-#else
-      logPrintf("%s = %f\n", buf, value);
-#endif
+/*
+ * Conversion must be waited for slowest
+ * sensor on bus. Sensors read during ROM search
+ * are not necessarily in table yet, and sensors
+ * with pending configuration still use their old
+ * resolution, so worst case is used for them.
+ */
+static int conversionWait(bool scan)
+{
+  int     ns;
+  int     ms = 0;
+  int     t;
+  Sensor* sensor;
 
-      sensorLock();
-      if (sensor->historyCount >= MAX_HISTORY) {
+  if (scan)
+    return DS_CONVERSION_MS;
 
-#if MAX_HISTORY > 1
-        memmove(sensor->temperature, sensor->temperature + 1, (MAX_HISTORY - 1) * sizeof(double));
-#endif
-        sensor->historyCount--;
-        printf("Sensor history was full.\n");
-      }
+  sensor = sensorList + 1;
+  for (ns = 1; ns < sensorCount; ns++, sensor++) {
+
+    if (!sensor->present)
+      continue;
 
-      sensor->temperature[sensor->historyCount++] = value;
-      if (sensor->historyCount > historyMax)
-        historyMax = sensor->historyCount;
+    if (sensor->configPending)
+      t = conversionTime(sensor->addr, DS_DEFAULT_BITS);
+    else
+      t = conversionTime(sensor->addr, sensor->resolution);
 
-      if (sensor->historyCount == MAX_HISTORY)
-        sendNeeded = true;
+    if (t > ms)
+      ms = t;
+  }
+
+  if (ms == 0)
+    ms = DS_CONVERSION_MS;
+
+  return ms;
+}
 
-      sensorUnlock();
+/*
+ * Perform full ROM search and read all sensors found.
+ */
+static bool scanBus()
+{
+  int     result;
+  int     ns;
+  uint8_t serialNum[8];
+  Sensor* sensor;
+  bool    full = false;
+
+  sensor = sensorList + 1;
+  for (ns = 1; ns < sensorCount; ns++, sensor++)
+    sensor->found = false;
+
+  result = owFirst(0, TRUE, FALSE);
+  while (result) {
+
+    owSerialNum(0, serialNum, TRUE);
+    sensor = getSensor(serialNum);
+    if (sensor == NULL)
+      break;
+
+    sensor->found = true;
+    if (addHistory(sensor, sampleSensor(sensor, serialNum)))
+      full = true;
+
+    result = owNext(0, TRUE, FALSE);
+  }
 
-      result = owNext(0, TRUE, FALSE);
+  sensor = sensorList + 1;
+  for (ns = 1; ns < sensorCount; ns++, sensor++) {
+
+    if (sensor->present != sensor->found) {
+
+      sensor->present = sensor->found;
+      inventoryDirty = true;
     }
+  }
 
-    owRelease(0);
+  rescanNeeded = false;
+  cyclesSinceScan = 0;
+  return full;
+}
 
-    // Don't read battery if sending, it will
-    // be read after wifi is on to get reading with load.
-    if (!sendNeeded && !online) {
+/*
+ * Read sensors in inventory using match rom.
+ */
+static bool readInventory()
+{
+  int     ns;
+  uint8_t serialNum[8];
+  Sensor* sensor;
+  int16_t value;
+  bool    full = false;
 
-      readBattery();
+  sensor = sensorList + 1;
+  for (ns = 1; ns < sensorCount; ns++, sensor++) {
 
-      sensor = sensorList;
-      sensorLock();
-      if (sensor->historyCount >= MAX_HISTORY) {
+    if (!sensor->present)
+      continue;
 
-#if MAX_HISTORY > 1
-        memmove(sensor->temperature, sensor->temperature + 1, (MAX_HISTORY - 1) * sizeof(double));
+    memcpy(serialNum, sensor->addr, sizeof(sensor->addr));
+    serialNum[7] = owRomCrc(serialNum);
+
+    value = sampleSensor(sensor, serialNum);
+    if (value == SAMPLE_INVALID)
+      rescanNeeded = true;
+
+    if (addHistory(sensor, value))
+      full = true;
+  }
+
+  ++cyclesSinceScan;
+  return full;
+}
+
+/*
+ * Read all sensors on bus. Returns true
+ * if sensor history is full.
+ */
+static bool readSensors()
+{
+  bool full;
+  bool scan;
+
+  if (!owAcquire(0, NULL)) {
+
+    printf("OneWire: owAcquire failed\n");
+    return false;
+  }
+
+  configureSensors();
+
+  // Convert all sensors in parallel, then
+  // read results one by one.
+  scan = rescanNeeded || cyclesSinceScan >= rescanCycles();
+  if (!convertAll(conversionWait(scan))) {
+
+    printf("OneWire: conversion failed\n");
+    rescanNeeded = true;
+    scan = true;
+  }
+
+  if (scan)
+    full = scanBus();
+  else
+    full = readInventory();
+
+  owRelease(0);
+#if EMW_HOST
+  owSimCycle();
 #endif
-        sensor->historyCount--;
-        printf("Sensor history was full.\n");
-      }
+  return full;
+}
+
+static void sensorThread(void* arg)
+{
+  char buf[30];
+  bool sendNeeded = true;
+  time_t  now;
+  struct timeval tv;
+  bool    online = staIsAlwaysOnline();
+
+  timerSema = nosSemaCreate(0, 0, "sensor*");
+  timer     = posTimerCreate();
+
+  gettimeofday(&tv, NULL);
+  sensorCycleReset(&tv);
+
+  while (true) {
+
+    nosSemaGet(timerSema);
+
+    // Watchdog thread samples cycle counter only when online,
+    // do it here so it cannot wrap between measurements.
+    energySample();
+
+    time(&now);
+    ctime_r(&now, buf);
+
+    now = (now / MEAS_CYCLE_SECS) * MEAS_CYCLE_SECS;
+    if ((now % SEND_CYCLE_SECS) == 0)
+      sendNeeded = true;
+
+    // Measure only once per time step, it is
+    // longer than cycle if history has been decimated.
+    if (++stepCycles >= historyStep) {
 
-      sensor->temperature[sensor->historyCount++] = battery;
-      if (sensor->historyCount > historyMax)
-        historyMax = sensor->historyCount;
+      stepCycles = 0;
+      sensorTime = now;
 
-      if (sensor->historyCount == MAX_HISTORY)
+      if (decimate && historyFull())
+        decimateHistory();
+
+      if (readSensors())
         sendNeeded = true;
 
-      sensorUnlock();
+      // Don't read battery if sending, it will
+      // be read after wifi is on to get reading with load.
+      if (!sendNeeded && !online) {
+
+        readBattery();
+        if (addHistory(sensorList, battery))
+          sendNeeded = true;
+      }
     }
 
     if (online || sendNeeded) {
@@ -343,9 +999,15 @@ void sensorInit()
   GPIO_InitTypeDef GPIO_InitStructure;
   ADC_InitTypeDef adcInit;
   ADC_CommonInitTypeDef adcCommonInit;
+  DMA_InitTypeDef dmaInit;
+  NVIC_InitTypeDef nvicInit;
 
+  sensorAlloc();
   sensorCount = 1; // we always have battery
 
+  const char* overflow = uosConfigGet("ow.overflow");
+  decimate = (overflow != NULL && !strcmp(overflow, "decimate"));
+
 // ADC init
 
   GPIO_InitStructure.GPIO_Pin = GPIO_Pin_5;
@@ -362,6 +1024,33 @@ void sensorInit()
   GPIO_Init(GPIOA, &GPIO_InitStructure);
 
   RCC_APB2PeriphClockCmd( RCC_APB2Periph_ADC1 , ENABLE);
+  RCC_AHB1PeriphClockCmd(RCC_AHB1Periph_DMA2, ENABLE);
+
+  adcSema = nosSemaCreate(0, 0, "adc*");
+
+// DMA2 stream 0 channel 0 is ADC1.
+  DMA_DeInit(DMA2_Stream0);
+  DMA_StructInit(&dmaInit);
+  dmaInit.DMA_Channel            = DMA_Channel_0;
+  dmaInit.DMA_PeripheralBaseAddr = (uintptr_t)&ADC1->DR;
+  dmaInit.DMA_Memory0BaseAddr    = (uintptr_t)adcSamples;
+  dmaInit.DMA_DIR                = DMA_DIR_PeripheralToMemory;
+  dmaInit.DMA_BufferSize         = BATTERY_OVERSAMPLE;
+  dmaInit.DMA_PeripheralInc      = DMA_PeripheralInc_Disable;
+  dmaInit.DMA_MemoryInc          = DMA_MemoryInc_Enable;
+  dmaInit.DMA_PeripheralDataSize = DMA_PeripheralDataSize_HalfWord;
+  dmaInit.DMA_MemoryDataSize     = DMA_MemoryDataSize_HalfWord;
+  dmaInit.DMA_Mode               = DMA_Mode_Normal;
+  dmaInit.DMA_Priority           = DMA_Priority_Low;
+  dmaInit.DMA_FIFOMode           = DMA_FIFOMode_Disable;
+  DMA_Init(DMA2_Stream0, &dmaInit);
+  DMA_ITConfig(DMA2_Stream0, DMA_IT_TC, ENABLE);
+
+  nvicInit.NVIC_IRQChannel                   = DMA2_Stream0_IRQn;
+  nvicInit.NVIC_IRQChannelPreemptionPriority = PORTCFG_API_MAX_PRI;
+  nvicInit.NVIC_IRQChannelSubPriority        = 0;
+  nvicInit.NVIC_IRQChannelCmd                = ENABLE;
+  NVIC_Init(&nvicInit);
 
   ADC_CommonStructInit(&adcCommonInit);
   adcCommonInit.ADC_Mode             = ADC_Mode_Independent;
@@ -372,15 +1061,18 @@ void sensorInit()
 
   ADC_StructInit(&adcInit);
 
-  adcInit.ADC_Resolution         = ADC_Resolution_8b;
+  adcInit.ADC_Resolution         = ADC_Resolution_12b;
   adcInit.ADC_ScanConvMode       = DISABLE;
-  adcInit.ADC_ContinuousConvMode = DISABLE;
+  adcInit.ADC_ContinuousConvMode = ENABLE;
   adcInit.ADC_ExternalTrigConv   = ADC_ExternalTrigConvEdge_None;
   adcInit.ADC_DataAlign          = ADC_DataAlign_Right;
   adcInit.ADC_NbrOfConversion    = 1;
   ADC_Init(ADC1, &adcInit);
 
-  ADC_RegularChannelConfig(ADC1, ADC_Channel_5, 1, ADC_SampleTime_3Cycles);
+  // Long sample time lets sampling capacitor charge fully
+  // from battery input.
+  ADC_RegularChannelConfig(ADC1, ADC_Channel_5, 1, ADC_SampleTime_480Cycles);
+  ADC_DMARequestAfterLastTransferCmd(ADC1, DISABLE);
 
 // 1-wire bus
   RCC_AHB1PeriphClockCmd(RCC_AHB1Periph_GPIOB, ENABLE);
@@ -407,6 +1099,7 @@ void sensorInit()
   owRelease(0);
 
   sensorMutex = nosMutexCreate(0, "sensor");
+  loadInventory();
 
   nosTaskCreate(sensorThread, NULL, 6, 1024, "OneWire");
   logPrintf("OneWire OK.\n");
@@ -427,6 +1120,10 @@ static int onewire(EshContext * ctx)
   char* location = eshNamedArg(ctx, "location", false);
   char* vera = eshNamedArg(ctx, "vera", false);
   char* address = eshNamedArg(ctx, "address", false);
+  char* rescan = eshNamedArg(ctx, "rescan", false);
+  char* resolution = eshNamedArg(ctx, "resolution", false);
+  char* max = eshNamedArg(ctx, "max", false);
+  char* overflow = eshNamedArg(ctx, "overflow", false);
 
   eshCheckNamedArgsUsed(ctx);
   eshCheckArgsUsed(ctx);
@@ -435,11 +1132,34 @@ static int onewire(EshContext * ctx)
 
   char key[36];
 
-  if (location || address || vera) {
+  if (rescan != NULL || max != NULL || overflow != NULL) {
 
-    if (address == NULL || (location == NULL && vera == NULL)) {
+    if (overflow != NULL) {
+
+      if (strcmp(overflow, "drop") && strcmp(overflow, "decimate")) {
+
+        eshPrintf(ctx, "--overflow must be drop or decimate.\n");
+        return -1;
+      }
 
-      eshPrintf(ctx, "--address and --location or --vera required.\n");
+      uosConfigSet("ow.overflow", overflow);
+      decimate = !strcmp(overflow, "decimate"); // takes effect now
+    }
+
+    if (rescan != NULL)
+      uosConfigSet("ow.rescan", rescan);
+
+    if (max != NULL)
+      uosConfigSet("ow.max", max);
+
+    return 0;
+  }
+
+  if (location || address || vera || resolution) {
+
+    if (address == NULL || (location == NULL && vera == NULL && resolution == NULL)) {
+
+      eshPrintf(ctx, "--address and --location, --vera or --resolution required.\n");
       return -1;
     }
 
@@ -455,6 +1175,19 @@ static int onewire(EshContext * ctx)
       uosConfigSet(key, vera);
     }
 
+    if (resolution != NULL) {
+
+      int bits = strtol(resolution, NULL, 10);
+      if (bits < 9 || bits > DS_DEFAULT_BITS) {
+
+        eshPrintf(ctx, "resolution must be 9-12 bits.\n");
+        return -1;
+      }
+
+      snprintf(key, sizeof(key), "or.%s", address);
+      uosConfigSet(key, resolution);
+    }
+
     return 0;
   }
 
@@ -493,18 +1226,70 @@ static int onewire(EshContext * ctx)
     if (loc != NULL)
       eshPrintf(ctx, " #%s", loc);
 
+    strcpy(key, "or.");
+    strcat(key, serialStr);
+    loc = uosConfigGet(key);
+    if (loc != NULL && loc[0] != '\0')
+      eshPrintf(ctx, " %s bits", loc);
+
     eshPrintf(ctx, "\n");
     rslt = owNext(0, TRUE, FALSE);
   }
 
   owRelease(0);
+
+  // Refresh inventory during next measurement cycle.
+  rescanNeeded = true;
   return 0;
 }
 
 const EshCommand onewireCommand = {
   .flags = 0,
   .name = "onewire",
-  .help = "list onewire bus, map location (--location=,--address=)",
+  .help = "list onewire bus, map location (--location=,--address=)\n"
+          "set sensor resolution (--resolution=9..12,--address=)\n"
+          "set inventory rescan interval in minutes (--rescan=)\n"
+          "set sensor table size, takes effect after reset (--max=)\n"
+          "set history overflow policy (--overflow=drop|decimate)",
   .handler = onewire
 };
 
+/*
+ * Show sensor table usage.
+ */
+static int sensors(EshContext * ctx)
+{
+  eshCheckNamedArgsUsed(ctx);
+  eshCheckArgsUsed(ctx);
+  if (eshArgError(ctx) != EshOK)
+    return -1;
+
+  int     ns;
+  char    serialStr[20];
+  Sensor* sensor;
+
+  sensorLock();
+  eshPrintf(ctx, "Sensors %d/%d, table %d bytes, index %d bytes.\n",
+                 sensorCount - 1,
+                 sensorCapacity - 1,
+                 (int)(sensorCapacity * sizeof(Sensor)),
+                 (int)(sensorIndexSize * sizeof(int16_t)));
+
+  sensor = sensorList + 1;
+  for (ns = 1; ns < sensorCount; ns++, sensor++) {
+
+    owAddr2Str(serialStr, sensor->addr);
+    eshPrintf(ctx, "%s%s history %d\n", serialStr, sensor->present ? "" : " (missing)", sensor->historyCount);
+  }
+
+  sensorUnlock();
+  return 0;
+}
+
+const EshCommand sensorsCommand = {
+  .flags = 0,
+  .name = "sensors",
+  .help = "show sensor table",
+  .handler = sensors
+};
+
@@ -0,0 +1,515 @@
+/*
+ * Copyright (c) 2019, Ari Suutari <ari@stonepile.fi>.
+ * All rights reserved. 
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 
+ *  1. Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *  3. The name of the author may not be used to endorse or promote
+ *     products derived from this software without specific prior written
+ *     permission. 
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS
+ * OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT,
+ * INDIRECT,  INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Store-and-forward spool for measurement windows that could
+ * not be sent. Windows are appended to segment files in spiffs,
+ * each record framed with magic, length and crc32. When
+ * all segments are in use, oldest segment is removed.
+ * Segment files are never rewritten, they are only appended
+ * to and finally removed after all records have been sent.
+ */
+
+#include <picoos.h>
+#include <picoos-u.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <eshell.h>
+#include "emw-sensor.h"
+
+#define SPOOL_SEGMENTS      8
+#define SPOOL_SEGMENT_SIZE  (16 * 1024)
+
+#define SPOOL_MAGIC         0x5053
+#define SPOOL_STATE_MAGIC   0x50534f53
+#define SPOOL_STATE_FILE    "/flash/spool.pos"
+
+typedef struct {
+
+  uint16_t magic;
+  uint16_t len;
+  uint32_t crc;
+} SpoolHeader;
+
+typedef struct {
+
+  uint32_t magic;
+  uint32_t first;     // oldest segment
+  uint32_t last;      // segment being appended to
+  uint32_t offset;    // read position in oldest segment
+} SpoolState;
+
+static SpoolState state;
+static SpoolState saved;
+static uint32_t   readNext;   // offset after record returned by spoolRead
+static int        pending;
+static int        dropped;
+
+static uint32_t crc32(const uint8_t* data, int len)
+{
+  uint32_t crc = 0xFFFFFFFF;
+  int      i;
+
+  while (len--) {
+
+    crc ^= *data++;
+    for (i = 0; i < 8; i++)
+      crc = (crc >> 1) ^ (0xEDB88320 & -(crc & 1));
+  }
+
+  return ~crc;
+}
+
+static void segmentName(char* buf, uint32_t seg)
+{
+  sprintf(buf, "/flash/spool.%lu", (unsigned long)seg);
+}
+
+/*
+ * Save read position and segment numbers if they
+ * have changed.
+ */
+void spoolSync()
+{
+  int fd;
+
+  if (!memcmp(&state, &saved, sizeof(state)))
+    return;
+
+  fd = open(SPOOL_STATE_FILE, O_WRONLY | O_CREAT | O_TRUNC);
+  if (fd == -1) {
+
+    printf("Cannot open " SPOOL_STATE_FILE ".\n");
+    return;
+  }
+
+  if (write(fd, &state, sizeof(state)) == sizeof(state))
+    saved = state;
+
+  close(fd);
+}
+
+static void dropSegment()
+{
+  char fn[30];
+
+  segmentName(fn, state.first);
+  uosFileUnlink(fn);
+
+  if (state.first == state.last)
+    ++state.last;
+
+  ++state.first;
+  state.offset = 0;
+}
+
+static int countRecords()
+{
+  char        fn[30];
+  int         fd;
+  uint32_t    seg;
+  SpoolHeader hdr;
+  int         count = 0;
+
+  for (seg = state.first; seg <= state.last; seg++) {
+
+    segmentName(fn, seg);
+    fd = open(fn, O_RDONLY);
+    if (fd == -1)
+      continue;
+
+    if (seg == state.first)
+      lseek(fd, state.offset, SEEK_SET);
+
+    while (read(fd, &hdr, sizeof(hdr)) == sizeof(hdr) && hdr.magic == SPOOL_MAGIC) {
+
+      ++count;
+      lseek(fd, hdr.len, SEEK_CUR);
+    }
+
+    close(fd);
+  }
+
+  return count;
+}
+
+void spoolInit()
+{
+  int fd;
+
+  memset(&state, '\0', sizeof(state));
+  state.magic = SPOOL_STATE_MAGIC;
+
+  fd = open(SPOOL_STATE_FILE, O_RDONLY);
+  if (fd != -1) {
+
+    if (read(fd, &saved, sizeof(saved)) == sizeof(saved) &&
+        saved.magic == SPOOL_STATE_MAGIC &&
+        saved.last - saved.first < SPOOL_SEGMENTS)
+      state = saved;
+
+    close(fd);
+  }
+
+  saved = state;
+  pending = countRecords();
+  if (pending > 0)
+    logPrintf("Spool has %d unsent windows.\n", pending);
+}
+
+static uint8_t* put16(uint8_t* ptr, uint16_t v)
+{
+  *ptr++ = v & 0xFF;
+  *ptr++ = v >> 8;
+  return ptr;
+}
+
+static const uint8_t* get16(const uint8_t* ptr, uint16_t* v)
+{
+  *v = ptr[0] | (ptr[1] << 8);
+  return ptr + 2;
+}
+
+/*
+ * Spool is drained only by MQTT client, so
+ * there is no use for it without MQTT server.
+ */
+static bool spoolEnabled()
+{
+#if USE_MQTT
+  const char* server = uosConfigGet("mqtt.server");
+
+  return server != NULL && server[0] != '\0';
+#else
+  return false;
+#endif
+}
+
+/*
+ * Append current sensor history to spool as one
+ * window and clear history. Must be called with
+ * sensor lock held and flash powered up. If spool
+ * is not in use, history is kept in memory.
+ */
+bool spoolHistory()
+{
+  char        fn[30];
+  int         fd;
+  int         ns;
+  int         i;
+  int         len;
+  int         size;
+  Sensor*     sensor;
+  uint8_t*    rec;
+  uint8_t*    ptr;
+  SpoolHeader hdr;
+  bool        empty = true;
+
+  if (!spoolEnabled())
+    return false;
+
+  sensor = sensorList;
+  for (ns = 0; ns < sensorCount; ns++, sensor++)
+    if (ns > 0 && sensor->historyCount > 0)
+      empty = false;
+
+  if (empty)
+    return true;
+
+  len = 4 + 2 + 1;
+  sensor = sensorList;
+  for (ns = 0; ns < sensorCount; ns++, sensor++)
+    len += sizeof(sensor->addr) + 1 + 2 * sensor->historyCount;
+
+  rec = nosMemAlloc(sizeof(hdr) + len);
+  if (rec == NULL)
+    return false;
+
+  ptr = rec + sizeof(hdr);
+  ptr = put16(ptr, sensorTime & 0xFFFF);
+  ptr = put16(ptr, sensorTime >> 16);
+  ptr = put16(ptr, sensorTimeStep());
+  *ptr++ = sensorCount;
+
+  sensor = sensorList;
+  for (ns = 0; ns < sensorCount; ns++, sensor++) {
+
+    memcpy(ptr, sensor->addr, sizeof(sensor->addr));
+    ptr += sizeof(sensor->addr);
+    *ptr++ = sensor->historyCount;
+    for (i = 0; i < sensor->historyCount; i++)
+      ptr = put16(ptr, sensorHistory(sensor, i));
+  }
+
+  hdr.magic = SPOOL_MAGIC;
+  hdr.len   = len;
+  hdr.crc   = crc32(rec + sizeof(hdr), len);
+  memcpy(rec, &hdr, sizeof(hdr));
+
+  segmentName(fn, state.last);
+  fd = open(fn, O_WRONLY | O_CREAT | O_APPEND);
+  if (fd == -1) {
+
+    nosMemFree(rec);
+    printf("Cannot open %s.\n", fn);
+    return false;
+  }
+
+  size = lseek(fd, 0, SEEK_END);
+  if (size > 0 && size + (int)sizeof(hdr) + len > SPOOL_SEGMENT_SIZE) {
+
+    // Segment full, continue in next one.
+    close(fd);
+    ++state.last;
+    if (state.last - state.first >= SPOOL_SEGMENTS) {
+
+      pending = -1;
+      ++dropped;
+      dropSegment();
+    }
+
+    segmentName(fn, state.last);
+    fd = open(fn, O_WRONLY | O_CREAT | O_TRUNC);
+    if (fd == -1) {
+
+      nosMemFree(rec);
+      printf("Cannot open %s.\n", fn);
+      return false;
+    }
+  }
+
+  len += sizeof(hdr);
+  if (write(fd, rec, len) != len) {
+
+    close(fd);
+    nosMemFree(rec);
+    printf("Cannot write %s.\n", fn);
+    return false;
+  }
+
+  close(fd);
+  nosMemFree(rec);
+
+  if (pending == -1)
+    pending = countRecords();
+  else
+    ++pending;
+
+  spoolSync();
+  sensorClearHistory();
+  logPrintf("Measurements spooled, %d windows pending.\n", pending);
+  return true;
+}
+
+int spoolPending()
+{
+  return pending;
+}
+
+/*
+ * Read oldest window from spool. Sensor histories
+ * are allocated and must be released with spoolFree.
+ * Returns false if spool is empty or there is not
+ * enough memory now, record stays in spool then.
+ */
+bool spoolRead(Window* w)
+{
+  char           fn[30];
+  int            fd;
+  int            ns;
+  int            i;
+  SpoolHeader    hdr;
+  uint8_t*       rec;
+  const uint8_t* ptr;
+  const uint8_t* end;
+  uint16_t       v;
+  uint16_t       hi;
+  Sensor*        sensor;
+  Sensor*        known;
+
+  memset(w, '\0', sizeof(*w));
+  while (pending > 0) {
+
+    segmentName(fn, state.first);
+    fd = open(fn, O_RDONLY);
+    if (fd != -1) {
+
+      lseek(fd, state.offset, SEEK_SET);
+      if (read(fd, &hdr, sizeof(hdr)) == sizeof(hdr)) {
+
+        if (hdr.magic == SPOOL_MAGIC) {
+
+          rec = nosMemAlloc(hdr.len);
+          if (rec == NULL) {
+
+            // Record is fine, try again when there is memory.
+            close(fd);
+            return false;
+          }
+
+          if (read(fd, rec, hdr.len) == hdr.len && crc32(rec, hdr.len) == hdr.crc) {
+
+            close(fd);
+            readNext = state.offset + sizeof(hdr) + hdr.len;
+            break;
+          }
+
+          nosMemFree(rec);
+        }
+
+        // Corrupted record, rest of segment cannot be trusted.
+        printf("Spool segment %s corrupted.\n", fn);
+      }
+
+      close(fd);
+    }
+
+    // End of segment.
+    if (state.first == state.last) {
+
+      pending = 0;
+      return false;
+    }
+
+    dropSegment();
+    pending = countRecords();
+  }
+
+  if (pending <= 0)
+    return false;
+
+  ptr = rec;
+  end = rec + hdr.len;
+
+  ptr = get16(ptr, &v);
+  ptr = get16(ptr, &hi);
+  w->time = ((uint32_t)hi << 16) | v;
+  ptr = get16(ptr, &v);
+  w->timeStep = v;
+  w->count = *ptr++;
+  w->live = false;
+  w->sensors = nosMemAlloc(w->count * sizeof(Sensor));
+  if (w->sensors == NULL) {
+
+    nosMemFree(rec);
+    return false;
+  }
+
+  memset(w->sensors, '\0', w->count * sizeof(Sensor));
+  sensor = w->sensors;
+  for (ns = 0; ns < w->count && ptr < end; ns++, sensor++) {
+
+    memcpy(sensor->addr, ptr, sizeof(sensor->addr));
+    ptr += sizeof(sensor->addr);
+    sensor->historyCount = *ptr++;
+    if (sensor->historyCount > MAX_HISTORY)
+      sensor->historyCount = MAX_HISTORY;
+
+    for (i = 0; i < sensor->historyCount; i++) {
+
+      ptr = get16(ptr, &v);
+      sensor->history[i] = (int16_t)v;
+    }
+
+    if (ns > 0 && (known = sensorFind(sensor->addr)) != NULL) {
+
+#if USE_MQTT
+      sensor->location = known->location;
+#endif
+#if USE_VERA
+      sensor->veraId = known->veraId;
+#endif
+    }
+  }
+
+  w->count = ns;
+  nosMemFree(rec);
+  return true;
+}
+
+void spoolFree(Window* w)
+{
+  if (w->sensors != NULL)
+    nosMemFree(w->sensors);
+
+  w->sensors = NULL;
+}
+
+/*
+ * Remove window returned by spoolRead from spool.
+ * Position is persisted by spoolSync.
+ */
+void spoolAck()
+{
+  state.offset = readNext;
+  --pending;
+}
+
+/*
+ * Show spool status.
+ */
+static int spool(EshContext * ctx)
+{
+  char* clear = eshNamedArg(ctx, "clear", false);
+
+  eshCheckNamedArgsUsed(ctx);
+  eshCheckArgsUsed(ctx);
+  if (eshArgError(ctx) != EshOK)
+    return -1;
+
+  sensorLock();
+  if (clear) {
+
+    while (state.first != state.last)
+      dropSegment();
+
+    dropSegment();
+    pending = 0;
+    spoolSync();
+  }
+
+  eshPrintf(ctx, "Pending windows %d, segments %lu-%lu, dropped segments %d.\n",
+                 pending,
+                 (unsigned long)state.first,
+                 (unsigned long)state.last,
+                 dropped);
+  sensorUnlock();
+  return 0;
+}
+
+const EshCommand spoolCommand = {
+  .flags = 0,
+  .name = "spool",
+  .help = "show unsent measurement spool (--clear to remove it)",
+  .handler = spool
+};
@@ -37,6 +37,7 @@
 #include <stdbool.h>
 #include <fcntl.h>
 #include <sys/time.h>
+#include <time.h>
 
 #include "lwip/mem.h"
 #include "lwip/memp.h"
@@ -49,6 +50,7 @@
 #include "lwip/netif.h"
 #include "lwip/netifapi.h"
 #include <lwip/dhcp.h>
+#include "lwip/prot/dhcp.h"
 #include "lwip/tcpip.h"
 #include "lwip/ip_addr.h"
 #include "apps/dhcps/dhcps.h"
@@ -115,37 +117,32 @@ void ifStatusCallback(struct netif *netif)
 
 struct netif defaultIf;
 static POSFLAG_t sntpFlag;
-static time_t lastNtp = 0;
+static bool randomSeeded = false;
 
 void staInit()
 {
   ready = nosSemaCreate(0, 0, "tcpok");
   sntpFlag = nosFlagCreate("sntp");
+  clockRestore();
 }
 
-void setSystemTime(time_t t)
+void setSystemTime(time_t t, uint32_t us)
 {
   struct timeval tv;
   char buf[30];
 
-  if (lastNtp == 0)
-    sys_random_init(t);
+  if (!randomSeeded) {
 
-  gettimeofday(&tv, NULL);
+    sys_random_init(t);
+    randomSeeded = true;
+  }
 
-  // Adjust wall clock time if difference is more than
-  // one second or more than 24 hours have passed since last
-  // adjustment.
-  if (abs(tv.tv_sec - t) > 1 || abs(t - lastNtp) > 3600 * 24) {
+  if (clockSync(t, us)) {
 
     ctime_r(&t, buf);
     logPrintf("Setting clock to %s", buf);
 
-    lastNtp = t;
-    tv.tv_sec = t;
-    tv.tv_usec = 0;
-    settimeofday(&tv, NULL);
-
+    gettimeofday(&tv, NULL);
     sensorCycleReset(&tv);
   }
 
@@ -154,7 +151,40 @@ void setSystemTime(time_t t)
 
 void waitSystemTime()
 {
+  JIF_t start = jiffies;
+
   nosFlagWait(sntpFlag, MS(2000));
+  timingPhase(PHASE_SNTP, start);
+}
+
+/*
+ * DHCP lease is kept over staDown, so that next staUp
+ * can use the address at once. lwip timers don't run
+ * while tcpip thread is suspended, so lease expiry is
+ * tracked here in wall clock time.
+ */
+#define LEASE_MARGIN_SECS 60
+
+static time_t leaseExpiry = 0;
+
+static void leaseSave(void* arg)
+{
+  struct dhcp* dhcp = netif_dhcp_data(&defaultIf);
+  time_t now;
+
+  time(&now);
+  if (dhcp == NULL || dhcp->state != DHCP_STATE_BOUND || !timeOk())
+    leaseExpiry = 0;
+  else
+    leaseExpiry = now + (dhcp->t0_timeout - dhcp->lease_used) * DHCP_COARSE_TIMER_SECS;
+}
+
+static bool leaseValid()
+{
+  time_t now;
+
+  time(&now);
+  return leaseExpiry != 0 && timeOk() && now + LEASE_MARGIN_SECS < leaseExpiry;
 }
 
 static void sntpStartStop(void* arg)
@@ -167,10 +197,190 @@ static void sntpStartStop(void* arg)
     sntp_stop();
 }
 
-bool staUp()
+/*
+ * AP of last successful join. Next join is directed to
+ * same BSSID and channel with PMK derived from passphrase,
+ * so that chip doesn't need to scan all channels or derive
+ * key again. Full scan is done if directed join fails.
+ */
+static wiced_scan_result_t lastAp;
+static bool                haveLastAp = false;
+static char                pmk[WSEC_MAX_PSK_LEN + 1];
+static bool                havePmk = false;
+
+static void forgetAp()
+{
+  haveLastAp = false;
+  havePmk = false;
+}
+
+static void rememberAp(const wiced_ssid_t* ssid, const char* pass)
+{
+  uint32_t channel;
+
+  memset(&lastAp, '\0', sizeof(lastAp));
+  lastAp.SSID     = *ssid;
+  lastAp.security = WICED_SECURITY_WPA2_MIXED_PSK;
+  lastAp.bss_type = WICED_BSS_TYPE_INFRASTRUCTURE;
+  lastAp.band     = WICED_802_11_BAND_2_4GHZ;
+
+  if (wwd_wifi_get_bssid(&lastAp.BSSID) != WWD_SUCCESS ||
+      wwd_wifi_get_channel(WWD_STA_INTERFACE, &channel) != WWD_SUCCESS)
+    return;
+
+  lastAp.channel = channel;
+  haveLastAp = true;
+
+  if (!havePmk && wwd_wifi_get_pmk(pass, strlen(pass), pmk) == WWD_SUCCESS) {
+
+    pmk[WSEC_MAX_PSK_LEN] = '\0';
+    havePmk = true;
+  }
+}
+
+static wwd_result_t join(const char* ap, const char* pass)
 {
   wiced_ssid_t ssid;
   wwd_result_t result;
+  JIF_t        start = jiffies;
+
+  strcpy((char*)ssid.value, ap);
+  ssid.length = strlen(ap);
+
+  if (haveLastAp) {
+
+    const char* key = havePmk ? pmk : pass;
+
+    result = wwd_wifi_join_specific(&lastAp, (const uint8_t*)key, strlen(key), NULL, WWD_STA_INTERFACE);
+    if (result == WWD_SUCCESS) {
+
+      logPrintf("Joined %s on channel %d in %d ms.\n", ap, lastAp.channel, (int)(jiffies - start));
+      return result;
+    }
+
+    logPrintf("Directed join failed, error %d, scanning.\n", result);
+    forgetAp();
+  }
+
+  result = wwd_wifi_join(&ssid, WICED_SECURITY_WPA2_MIXED_PSK, (uint8_t*)pass, strlen(pass), NULL, WWD_STA_INTERFACE);
+  if (result == WWD_SUCCESS) {
+
+    rememberAp(&ssid, pass);
+    logPrintf("Joined %s with scan in %d ms.\n", ap, (int)(jiffies - start));
+  }
+
+  return result;
+}
+
+/*
+ * Radio power policy between cycles in offline mode. Chip
+ * can be powered off, which means that firmware must be
+ * loaded again, or it can be left down with firmware
+ * resident, which costs standby current. With auto
+ * policy radio sleeps if send interval is shorter than
+ * the time in which standby current uses same charge as
+ * firmware load.
+ */
+#define RADIO_OFF   0
+#define RADIO_SLEEP 1
+#define RADIO_AUTO  2
+
+static bool resident = false;
+static int  loadMs;    // last firmware load
+static int  resumeMs;  // last resume from sleep
+
+static int radioPolicy()
+{
+  const char* value = uosConfigGet("radio");
+
+  if (value != NULL && !strcmp(value, "sleep"))
+    return RADIO_SLEEP;
+
+  if (value != NULL && !strcmp(value, "auto"))
+    return RADIO_AUTO;
+
+  return RADIO_OFF;
+}
+
+/*
+ * Send interval where resident sleep and power off use
+ * same charge, seconds. Zero if not known yet.
+ */
+static int breakEvenSecs()
+{
+  int    standby = energyCurrent(ENERGY_STANDBY);
+  double saved;
+
+  if (loadMs == 0 || standby <= 0)
+    return 0;
+
+  // Charge saved by not loading firmware, uA * s.
+  saved = (loadMs - resumeMs) / 1000.0 * (energyCurrent(ENERGY_RUN) + energyCurrent(ENERGY_RADIO));
+  if (saved <= 0)
+    return 0;
+
+  return saved / standby;
+}
+
+static bool radioSleep()
+{
+  switch (radioPolicy()) {
+  case RADIO_SLEEP:
+    return true;
+
+  case RADIO_AUTO:
+    return breakEvenSecs() > SEND_CYCLE_SECS;
+
+  default:
+    return false;
+  }
+}
+
+static wwd_result_t radioOn()
+{
+  wwd_result_t result;
+  JIF_t        start = jiffies;
+
+  if (resident) {
+
+    resident = false;
+    energyOff(ENERGY_STANDBY);
+    result = wwd_wifi_set_up();
+    if (result == WWD_SUCCESS) {
+
+      resumeMs = jiffies - start;
+      return result;
+    }
+
+    printf("Cannot resume wifi, error %d, reloading firmware.\n", result);
+    wwd_management_wifi_off();
+    start = jiffies;
+  }
+
+  result = wwd_management_wifi_on(WICED_COUNTRY_FINLAND);
+  if (result == WWD_SUCCESS)
+    loadMs = jiffies - start;
+
+  return result;
+}
+
+static void radioOff()
+{
+  if (radioSleep() && wwd_wifi_set_down() == WWD_SUCCESS) {
+
+    resident = true;
+    energyOn(ENERGY_STANDBY);
+  }
+  else
+    wwd_management_wifi_off();
+
+  energyOff(ENERGY_RADIO);
+}
+
+bool staUp()
+{
+  wwd_result_t result;
+  JIF_t        start;
 
   /*
    * Get AP network name and password and attempt to join.
@@ -187,23 +397,28 @@ bool staUp()
   }
 
   wifiLed(true);
-  result = wwd_management_wifi_on(WICED_COUNTRY_FINLAND);
+  start = jiffies;
+  energyOn(ENERGY_RADIO); // firmware load is included
+  result = radioOn();
+  timingPhase(PHASE_WIFI_ON, start);
   if (result != WWD_SUCCESS) {
 
     wifiLed(false);
     printf("Cannot turn wifi on, error %d.\n", result);
     wwd_management_wifi_off();
+    energyOff(ENERGY_RADIO);
     return false;
   }
 
   wifiLed(false);
-  strcpy((char*)ssid.value, ap);
-  ssid.length = strlen(ap);
 
-  result = wwd_wifi_join(&ssid, WICED_SECURITY_WPA2_MIXED_PSK, (uint8_t*)pass, strlen(pass), NULL, WWD_STA_INTERFACE);
+  start = jiffies;
+  result = join(ap, pass);
+  timingPhase(PHASE_JOIN, start);
   if (result != WWD_SUCCESS) {
 
     wwd_management_wifi_off();
+    energyOff(ENERGY_RADIO);
     wifiLed(false);
     printf("Cannot join AP, error %d.\n", result);
     return false;
@@ -212,10 +427,25 @@ bool staUp()
   // Ensure that semaphore is not set yet
   while (nosSemaWait(ready, 0) == 0);
 
-  netifapi_netif_set_up(&defaultIf);
+  start = jiffies;
   netif_set_status_callback(&defaultIf, ifStatusCallback);
   sntp_servermode_dhcp(1);
-  netifapi_dhcp_start(&defaultIf);
+  if (leaseValid()) {
+
+    // Address is still on interface, so it is ready as soon
+    // as it is up. Link up makes lwip dhcp confirm lease
+    // with INIT-REBOOT request, NAK starts discovery.
+    netifapi_netif_set_up(&defaultIf);
+    netifapi_netif_set_link_up(&defaultIf);
+  }
+  else {
+
+    leaseExpiry = 0;
+    netifapi_dhcp_stop(&defaultIf);
+    netifapi_netif_set_up(&defaultIf);
+    netifapi_netif_set_link_up(&defaultIf);
+    netifapi_dhcp_start(&defaultIf);
+  }
 
 #if LWIP_IPV6
   netif_create_ip6_linklocal_address(&defaultIf, 1);
@@ -223,7 +453,10 @@ bool staUp()
   defaultIf.ip6_autoconfig_enabled = 1;
 #endif
 
-  if (nosSemaWait(ready, MS(10000)) != 0) {
+  bool leased = nosSemaWait(ready, MS(10000)) == 0;
+
+  timingPhase(PHASE_DHCP, start);
+  if (!leased) {
 
     printf("No DHCP lease.\n");
     staDown();
@@ -233,7 +466,12 @@ bool staUp()
   // Ensure that flag is not set yet
   nosFlagWait(sntpFlag, 0);
 
-  if (fixedNtp != NULL && strlen(fixedNtp) > 0) {
+  if (!clockNeedsSync()) {
+
+    // Clock is good enough, continue without SNTP.
+    nosFlagSet(sntpFlag, 0);
+  }
+  else if (fixedNtp != NULL && strlen(fixedNtp) > 0) {
 
     sntp_setservername(0, fixedNtp);
     tcpip_callback_with_block(sntpStartStop, (void*)true, true);
@@ -250,12 +488,24 @@ bool staUp()
 
 void staDown()
 {
+  JIF_t start = jiffies;
+
   tcpip_callback_with_block(sntpStartStop, (void*)false, true);
-  netifapi_dhcp_release(&defaultIf);
-  netifapi_dhcp_stop(&defaultIf);
+  tcpip_callback_with_block(leaseSave, NULL, true);
+  if (leaseExpiry != 0) {
+
+    netifapi_netif_set_link_down(&defaultIf);
+  }
+  else {
+
+    netifapi_dhcp_release(&defaultIf);
+    netifapi_dhcp_stop(&defaultIf);
+  }
+
   netifapi_netif_set_down(&defaultIf);
   wwd_wifi_leave(WWD_STA_INTERFACE);
-  wwd_management_wifi_off();
+  radioOff();
+  timingPhase(PHASE_DOWN, start);
 }
 
 /*
@@ -287,6 +537,7 @@ static int sta(EshContext* ctx)
     uosConfigSet("pass", "");
     uosConfigSet("online", "");
     uosConfigSet("ntp", "");
+    forgetAp();
     return 0;
   }
 
@@ -300,6 +551,8 @@ static int sta(EshContext* ctx)
   uosConfigSet("ntp", ntp != NULL ? ntp : "");
   uosConfigSet("ap", ap);
   uosConfigSet("pass", pass);
+  leaseExpiry = 0;
+  forgetAp();
 
   return 0;
 }
@@ -375,6 +628,49 @@ const EshCommand copyfwCommand = {
 
 #endif
 
+/*
+ * Set radio power policy, show firmware load
+ * and resume times.
+ */
+static int radio(EshContext* ctx)
+{
+  char* policy = eshNamedArg(ctx, "policy", false);
+
+  eshCheckNamedArgsUsed(ctx);
+  eshCheckArgsUsed(ctx);
+  if (eshArgError(ctx) != EshOK)
+    return -1;
+
+  if (policy != NULL) {
+
+    if (strcmp(policy, "off") && strcmp(policy, "sleep") && strcmp(policy, "auto")) {
+
+      eshPrintf(ctx, "Policy must be off, sleep or auto.\n");
+      return -1;
+    }
+
+    uosConfigSet("radio", policy);
+    return 0;
+  }
+
+  static const char* const policies[] = { "off", "sleep", "auto" };
+
+  eshPrintf(ctx, "Policy: %s, radio %s between cycles.\n", policies[radioPolicy()], radioSleep() ? "sleeps" : "is off");
+  eshPrintf(ctx, "Firmware load %d ms, resume %d ms.\n", loadMs, resumeMs);
+  eshPrintf(ctx, "Standby %d uA, break-even interval %d s, send interval %d s.\n",
+                 energyCurrent(ENERGY_STANDBY),
+                 breakEvenSecs(),
+                 SEND_CYCLE_SECS);
+  return 0;
+}
+
+const EshCommand radioCommand = {
+  .flags = 0,
+  .name = "radio",
+  .help = "set wifi power policy between cycles (--policy=off|sleep|auto)",
+  .handler = radio
+};
+
 const EshCommand staCommand = {
   .flags = 0,
   .name = "sta",
@@ -407,6 +703,16 @@ extern const EshCommand veraCommand;
 extern const EshCommand apCommand;
 extern const EshCommand resetCommand;
 extern const EshCommand onewireCommand;
+extern const EshCommand sensorsCommand;
+extern const EshCommand spoolCommand;
+extern const EshCommand timingCommand;
+extern const EshCommand energyCommand;
+extern const EshCommand radioCommand;
+extern const EshCommand clockCommand;
+
+#if EMW_HOST
+extern const EshCommand owsimCommand;
+#endif
 
 const EshCommand *eshCommandList[] = {
 #if BUNDLE_FIRMWARE
@@ -419,6 +725,8 @@ const EshCommand *eshCommandList[] = {
   &veraCommand,
 #endif
   &staCommand,
+  &radioCommand,
+  &clockCommand,
   &wrCommand,
   &clearCommand,
 #if defined(POS_DEBUGHELP) || NOSCFG_FEATURE_REGISTRY
@@ -431,6 +739,13 @@ const EshCommand *eshCommandList[] = {
   &eshExitCommand,
   &resetCommand,
   &onewireCommand,
+  &sensorsCommand,
+  &spoolCommand,
+  &timingCommand,
+  &energyCommand,
+#if EMW_HOST
+  &owsimCommand,
+#endif
   NULL
 };
 
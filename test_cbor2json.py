@@ -0,0 +1,116 @@
+#!/usr/bin/env python3
+#
+# Copyright (c) 2019, Ari Suutari <ari@stonepile.fi>.
+# All rights reserved. 
+# 
+# Redistribution and use in source and binary forms, with or without
+# modification, are permitted provided that the following conditions
+# are met:
+# 
+#  1. Redistributions of source code must retain the above copyright
+#     notice, this list of conditions and the following disclaimer.
+#  2. Redistributions in binary form must reproduce the above copyright
+#     notice, this list of conditions and the following disclaimer in the
+#     documentation and/or other materials provided with the distribution.
+#  3. The name of the author may not be used to endorse or promote
+#     products derived from this software without specific prior written
+#     permission. 
+# 
+# THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS
+# OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+# WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+# ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT,
+# INDIRECT,  INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+# (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+# SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+# HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+# STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+# ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+# OF THE POSSIBILITY OF SUCH DAMAGE.
+#
+# Tests for cbor2json.py. Fixtures below are output of
+# host/test/payloadtest (payload.c encoder). When EMW_PAYLOADTEST
+# points to it, CBOR and JSON output are also compared directly.
+# Run with python3 test_cbor2json.py
+#
+
+import json
+import math
+import os
+import subprocess
+import sys
+import unittest
+
+import cbor2json
+
+# Half-float temperatures.
+PLAIN = bytes.fromhex(
+    "bf6874696d65537465701902586974696d655374616d7074323031392d30352d"
+    "30315431323a30303a30305a696c6f636174696f6e73bf676b69746368656ebf"
+    "6b74656d70657261747572659ff94d60f94d68f6f94d5cf9b000f95410ffff6e"
+    "67617261676520226e6f72746822bf6c74656d7065726174757265319ff9c100"
+    "f6f9c120ffff6b6b69746368656e4e6f6465bf6472737369383c66757074696d"
+    "651a000186a06762617474657279fa4039999affffff")
+
+PLAIN_JSON = '{"timeStep":600,"timeStamp":"2019-05-01T12:00:00Z","locations":{"kitchen":{"temperature":[21.5,21.625,null,21.4375,-0.125,65]},"garage \\"north\\"":{"temperature1":[-2.5,null,-2.5625]},"kitchenNode":{"rssi":-61,"uptime":100000,"battery":2.9}}}'
+
+# Delta encoded temperatures.
+DELTA = bytes.fromhex(
+    "bf6874696d65537465701902586564656c7461106974696d655374616d707432"
+    "3031392d30352d30315431323a30303a30305a696c6f636174696f6e73bf676b"
+    "69746368656ebf6b74656d70657261747572659f19015802f622390158190412"
+    "ffff6e67617261676520226e6f72746822bf6c74656d7065726174757265319f"
+    "3827f620ffff6b6b69746368656e4e6f6465bf6472737369383c66757074696d"
+    "651a000186a06762617474657279fa4039999affffff")
+
+DELTA_JSON = '{"timeStep":600,"delta":16,"timeStamp":"2019-05-01T12:00:00Z","locations":{"kitchen":{"temperature":[344,2,null,-3,-345,1042]},"garage \\"north\\"":{"temperature1":[-40,null,-1]},"kitchenNode":{"rssi":-61,"uptime":100000,"battery":2.9}}}'
+
+SCRIPT = os.path.join(os.path.dirname(os.path.abspath(__file__)), "cbor2json.py")
+PAYLOADTEST = os.environ.get("EMW_PAYLOADTEST")
+
+def same(a, b):
+    """Compare decoded values, floats with single precision."""
+    if isinstance(a, float) or isinstance(b, float):
+        return math.isclose(a, b, rel_tol=1e-6)
+    if isinstance(a, dict):
+        return list(a) == list(b) and all(same(a[k], b[k]) for k in a)
+    if isinstance(a, list):
+        return len(a) == len(b) and all(same(x, y) for x, y in zip(a, b))
+    return a == b
+
+class TestDecode(unittest.TestCase):
+
+    def convert(self, data):
+        out = subprocess.run([sys.executable, SCRIPT], input=data,
+                             stdout=subprocess.PIPE, check=True).stdout
+        return json.loads(out)
+
+    def check(self, decoded, expected):
+        self.assertTrue(same(decoded, json.loads(expected)),
+                        "%s != %s" % (decoded, expected))
+
+    def test_half_float(self):
+        self.check(cbor2json.decode(PLAIN), PLAIN_JSON)
+        self.check(self.convert(PLAIN), PLAIN_JSON)
+
+    def test_delta(self):
+        self.check(cbor2json.decode(DELTA), DELTA_JSON)
+        self.check(self.convert(DELTA), DELTA_JSON)
+
+    def test_extra_bytes(self):
+        self.assertRaises(ValueError, cbor2json.decode, PLAIN + b"\n")
+
+    def test_truncated(self):
+        self.assertRaises((ValueError, IndexError), cbor2json.decode, DELTA[:-3])
+
+    @unittest.skipUnless(PAYLOADTEST, "EMW_PAYLOADTEST not set")
+    def test_encoder(self):
+        for args in ([], ["delta"]):
+            cbor = subprocess.run([PAYLOADTEST, "cbor"] + args,
+                                  stdout=subprocess.PIPE, check=True).stdout
+            js = subprocess.run([PAYLOADTEST, "json"] + args,
+                                stdout=subprocess.PIPE, check=True).stdout
+            self.check(self.convert(cbor), js.decode())
+
+if __name__ == "__main__":
+    unittest.main()
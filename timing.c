@@ -0,0 +1,159 @@
+/*
+ * Copyright (c) 2019, Ari Suutari <ari@stonepile.fi>.
+ * All rights reserved. 
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 
+ *  1. Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *  3. The name of the author may not be used to endorse or promote
+ *     products derived from this software without specific prior written
+ *     permission. 
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS
+ * OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT,
+ * INDIRECT,  INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Breakdown of time spent awake during send cycles.
+ * Phases are timed with jiffies and kept in a small ring
+ * of recent cycles.
+ */
+
+#include <picoos.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <string.h>
+#include <time.h>
+#include <eshell.h>
+
+#include "emw-sensor.h"
+
+#define TIMING_HISTORY 8
+
+static const char* const phaseNames[PHASE_COUNT] = {
+  "wifi",
+  "join",
+  "dhcp",
+  "sntp",
+  "dns",
+  "connect",
+  "publish",
+  "vera",
+  "drain",
+  "down"
+};
+
+static CycleTiming ring[TIMING_HISTORY];
+static int         ringHead;  // next slot to use
+static int         ringCount;
+static CycleTiming current;
+static JIF_t       cycleStart;
+
+const char* timingPhaseName(int phase)
+{
+  return phaseNames[phase];
+}
+
+/*
+ * Start timing new cycle.
+ */
+void timingStart()
+{
+  memset(&current, '\0', sizeof(current));
+  time(&current.time);
+  cycleStart = jiffies;
+}
+
+/*
+ * Add time elapsed since start to given phase.
+ */
+void timingPhase(int phase, JIF_t start)
+{
+  int ms = jiffies - start;
+
+  if (current.phase[phase] + ms > UINT16_MAX)
+    current.phase[phase] = UINT16_MAX;
+  else
+    current.phase[phase] += ms;
+}
+
+/*
+ * Cycle is complete, store it into ring.
+ */
+void timingEnd()
+{
+  current.total = jiffies - cycleStart;
+
+  ring[ringHead] = current;
+  ringHead = (ringHead + 1) % TIMING_HISTORY;
+  if (ringCount < TIMING_HISTORY)
+    ++ringCount;
+}
+
+/*
+ * Most recent complete cycle, NULL if there is none.
+ */
+const CycleTiming* timingLast()
+{
+  if (ringCount == 0)
+    return NULL;
+
+  return &ring[(ringHead + TIMING_HISTORY - 1) % TIMING_HISTORY];
+}
+
+/*
+ * Show timing of recent cycles, oldest first.
+ */
+static int timing(EshContext* ctx)
+{
+  eshCheckNamedArgsUsed(ctx);
+  eshCheckArgsUsed(ctx);
+  if (eshArgError(ctx) != EshOK)
+    return -1;
+
+  int   i;
+  int   p;
+  char  buf[30];
+  const CycleTiming* c;
+
+  eshPrintf(ctx, "%-8s", "time");
+  for (p = 0; p < PHASE_COUNT; p++)
+    eshPrintf(ctx, " %7s", phaseNames[p]);
+
+  eshPrintf(ctx, " %7s\n", "total");
+
+  for (i = 0; i < ringCount; i++) {
+
+    c = &ring[(ringHead + TIMING_HISTORY - ringCount + i) % TIMING_HISTORY];
+    strftime(buf, sizeof(buf), "%H:%M:%S", gmtime(&c->time));
+    eshPrintf(ctx, "%-8s", buf);
+    for (p = 0; p < PHASE_COUNT; p++)
+      eshPrintf(ctx, " %7u", (unsigned)c->phase[p]);
+
+    eshPrintf(ctx, " %7d\n", c->total);
+  }
+
+  return 0;
+}
+
+const EshCommand timingCommand = {
+  .flags = 0,
+  .name = "timing",
+  .help = "show time spent in phases of recent send cycles (ms)",
+  .handler = timing
+};
@@ -103,9 +103,12 @@ bool veraSend()
     if (sensor->historyCount == 0 || sensor->veraId == 0)
       continue;
 
+    if (sensorHistory(sensor, sensor->historyCount - 1) == SAMPLE_INVALID)
+      continue;
+
 
     sprintf(url, "%s/data_request?id=variableset&DeviceNum=%d&serviceId=urn:upnp-org:serviceId:TemperatureSensor1&Variable=CurrentTemperature&Value=%.1f",
-                 server, sensor->veraId, sensor->temperature[sensor->historyCount - 1]);
+                 server, sensor->veraId, sampleToCelsius(sensorHistory(sensor, sensor->historyCount - 1)));
 
     status = pbGet(&client, url, NULL);
     if (status < 0) {
@@ -49,6 +49,7 @@ static void watchdogThread(void* arg)
 
     posTaskSleep(MS(10000));
     IWDG_ReloadCounter();
+    energySample();
   }
 }
 